@@ -7,6 +7,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -15,12 +19,33 @@
 #include "dos.h"
 
 
-static int imagesize = 0;
+/* Every image we have mapped, with its size, so that several images
+   can be open at once (scandisk --fleet maps many from one process) */
+struct mapping 
+{
+    uint8_t *image_buf;
+    size_t size;
+    struct mapping *next;
+};
 
-/* memory map the FAT-12  disk image file */
-uint8_t *mmap_file(char *filename, int *fd)
+static struct mapping *mappings = NULL;
+static pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint16_t find_free_near(uint16_t, uint8_t *, struct bpb33 *);
+static uint32_t data_clusters(struct bpb33 *);
+static struct direntry *take_dirent(struct direntry *, uint8_t *,
+				    struct bpb33 *);
+static void ra_hint(uint8_t *, uint8_t *, int);
+static int dir_iter_next_tasks(struct dir_iter *, struct dir_rec *);
+
+/* memory map the FAT-12 disk image file, or complain and return NULL.
+   With MAP_IMAGE_PRIVATE the file is opened read-only and mapped
+   copy-on-write: the caller may scribble on the mapping, but nothing
+   it does ever reaches the file. */
+uint8_t *map_image(char *filename, int *fd, int flags)
 {
     struct stat statbuf;
+    struct mapping *map;
     uint8_t *image_buf;
     char pathname[MAXPATHLEN+1];
 
@@ -31,6 +56,7 @@ uint8_t *mmap_file(char *filename, int *fd)
     if (filename[0] == '/') 
     {
 	strncpy(pathname, filename, MAXPATHLEN);
+	pathname[MAXPATHLEN] = '\0';
     } 
     else 
     {
@@ -38,7 +64,7 @@ uint8_t *mmap_file(char *filename, int *fd)
 	if (strlen(pathname) + strlen(filename) + 1 > MAXPATHLEN) 
 	{
 	    fprintf(stderr, "Filename too long\n");
-	    exit(1);
+	    return NULL;
 	}
 	strcat(pathname, "/");
 	strcat(pathname, filename);
@@ -52,37 +78,94 @@ uint8_t *mmap_file(char *filename, int *fd)
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
 		pathname, strerror(errno));
-	exit(1);
+	return NULL;
     }
-    imagesize = statbuf.st_size;
 
 
     /* Step 3: open the file for read/write */
 
-    *fd = open(pathname, O_RDWR);
+    *fd = open(pathname, (flags & MAP_IMAGE_PRIVATE) ? O_RDONLY : O_RDWR);
     if (*fd < 0) 
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
 		pathname, strerror(errno));
-	exit(1);
+	return NULL;
     }
 
 
     /* Step 4: we memory map the file */
 
-    image_buf = mmap(NULL, imagesize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    image_buf = mmap(NULL, statbuf.st_size, PROT_READ | PROT_WRITE, 
+		     (flags & MAP_IMAGE_PRIVATE) ? MAP_PRIVATE : MAP_SHARED, *fd, 0);
     if (image_buf == MAP_FAILED) 
     {
 	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
-	exit(1);
+	close(*fd);
+	return NULL;
     }
+
+    map = malloc(sizeof(struct mapping));
+    map->image_buf = image_buf;
+    map->size = statbuf.st_size;
+    pthread_mutex_lock(&mappings_lock);
+    map->next = mappings;
+    mappings = map;
+    pthread_mutex_unlock(&mappings_lock);
+    return image_buf;
+}
+
+
+uint8_t *mmap_file(char *filename, int *fd)
+{
+    uint8_t *image_buf = map_image(filename, fd, 0);
+
+    if (image_buf == NULL)
+	exit(1);
     return image_buf;
 }
 
 
+/* the size of a mapped image, or 0 if we didn't map it */
+size_t image_size(uint8_t *image_buf)
+{
+    struct mapping *map;
+    size_t size = 0;
+
+    pthread_mutex_lock(&mappings_lock);
+    for (map = mappings; map != NULL; map = map->next) 
+    {
+	if (map->image_buf == image_buf) 
+	{
+	    size = map->size;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&mappings_lock);
+    return size;
+}
+
+
 void unmmap_file(uint8_t *image, int *fd)
 {
-    munmap(image, imagesize);
+    struct mapping **link, *map = NULL;
+
+    pthread_mutex_lock(&mappings_lock);
+    for (link = &mappings; *link != NULL; link = &(*link)->next) 
+    {
+	if ((*link)->image_buf == image) 
+	{
+	    map = *link;
+	    *link = map->next;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&mappings_lock);
+
+    if (map != NULL) 
+    {
+	munmap(image, map->size);
+	free(map);
+    }
     close(*fd);
 }
 
@@ -227,6 +310,45 @@ void set_fat_entry(uint16_t clusternum, uint16_t value,
 }
 
 
+/* set_fat_entry_atomic is set_fat_entry for callers that may be
+   updating other FAT entries concurrently.  Two neighbouring 12-bit
+   entries share the middle byte of their 3-byte pair, so that byte
+   is updated with a compare-and-swap on the nibble we own; the outer
+   bytes belong to one entry only and can be stored directly. */
+void set_fat_entry_atomic(uint16_t clusternum, uint16_t value,
+			  uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t offset;
+    uint8_t *shared;
+    uint8_t old, new;
+
+    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
+	+ (3 * (clusternum/2));
+    shared = image_buf + offset + 1;
+    old = __atomic_load_n(shared, __ATOMIC_RELAXED);
+    switch(clusternum % 2) 
+    {
+    case 0:
+	*(image_buf + offset) = (uint8_t)(0xff & value);
+	do 
+	{
+	    new = (0xf0 & old) | (0x0f & (value >> 8));
+	} while (!__atomic_compare_exchange_n(shared, &old, new, 0,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	break;
+    case 1:
+	do 
+	{
+	    new = (0x0f & old) | ((0x0f & value) << 4);
+	} while (!__atomic_compare_exchange_n(shared, &old, new, 0,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	*(image_buf + offset + 2) = (uint8_t)(0xff & (value >> 4));
+	break;
+    }
+}
+
 int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
 {
     uint16_t max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
@@ -285,3 +407,2681 @@ uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf,
     return p;
 }
 
+
+
+/* get_name retrieves the filename from a directory entry */
+
+void get_name(char *fullname, struct direntry *dirent) 
+{
+    char name[9];
+    char extension[4];
+    int i;
+
+    name[8] = ' ';
+    extension[3] = ' ';
+    memcpy(name, &(dirent->deName[0]), 8);
+    memcpy(extension, dirent->deExtension, 3);
+
+    /* names are space padded - remove the padding */
+    for (i = 8; i > 0; i--) 
+    {
+	if (name[i] == ' ') 
+	    name[i] = '\0';
+	else 
+	    break;
+    }
+
+    /* extensions aren't normally space padded - but remove the
+       padding anyway if it's there */
+    for (i = 3; i >= 0; i--) 
+    {
+	if (extension[i] == ' ') 
+	    extension[i] = '\0';
+	else 
+	    break;
+    }
+    fullname[0]='\0';
+    strcat(fullname, name);
+
+    /* append the extension if it's not a directory */
+    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0 && 
+	extension[0] != '\0') 
+    {
+	strcat(fullname, ".");
+	strcat(fullname, extension);
+    }
+}
+
+
+/* find_file seeks through the directories in the memory disk image,
+   until it finds the named file.  Each directory cluster is read
+   under a shared lock on fd.  Returns NULL with errno set to ENOENT
+   if there is no such file (a volume label isn't one), or EISDIR if
+   the name is a directory, and leaves it to the caller to
+   complain. */
+
+struct direntry* find_file(char *infilename, uint16_t cluster,
+			   int find_mode, int fd,
+			   uint8_t *image_buf, struct bpb33* bpb)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    char buf[MAXPATHLEN];
+    char *seek_name, *next_name;
+    int d, entries = 0, steps = 0;
+    struct direntry *dirent;
+    uint16_t dir_cluster;
+    char fullname[13];
+
+    /* find the first dirent in this directory */
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+
+    /* first we need to split the file name we're looking for into the
+       first part of the path, and the remainder.  We hunt through the
+       current directory for the first part.  If there's a remainder,
+       and what we find is a directory, then we recurse, and search
+       that directory for the remainder */
+
+    strncpy(buf, infilename, MAXPATHLEN);
+    seek_name = buf;
+
+    /* trim leading slashes */
+    while (*seek_name == '/' || *seek_name == '\\') 
+    {
+	seek_name++;
+    }
+
+    /* search for any more slashes - if so, it's a dirname */
+    next_name = seek_name;
+    while (1) 
+    {
+	if (*next_name == '/' || *next_name == '\\') 
+	{
+	    *next_name = '\0';
+	    next_name ++;
+	    break;
+	}
+	if (*next_name == '\0') 
+	{
+	    /* end of name - no slashes found */
+	    next_name = NULL;
+	    if (find_mode == FIND_DIR) 
+	    {
+		return dirent;
+	    }
+	    break;
+	}
+	next_name++;
+    }
+
+    while (1) 
+    {
+	/* hunt a cluster for the relevant dirent.  If we reach the
+	   end of the cluster, we'll need to go to the next cluster
+	   for this directory */
+	lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_RDLCK);
+	for (d = 0; 
+	     d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
+	     d += sizeof(struct direntry)) 
+	{
+	    if (dirent->deName[0] == SLOT_EMPTY) 
+	    {
+		/* we failed to find the file */
+		lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_UNLCK);
+		errno = ENOENT;
+		return NULL;
+	    }
+
+	    if (dirent->deName[0] == SLOT_DELETED) 
+	    {
+		/* skip over a deleted file */
+		dirent++;
+		continue;
+	    }
+
+	    get_name(fullname, dirent);
+	    if (strcasecmp(fullname, seek_name)==0) 
+	    {
+		/* found it! */
+		if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
+		{
+		    /* it's a directory */
+		    if (next_name == NULL) 
+		    {
+			lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, 
+				 F_UNLCK);
+			errno = EISDIR;
+			return NULL;
+		    }
+		    dir_cluster = getushort(dirent->deStartCluster);
+		    lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_UNLCK);
+		    return find_file(next_name, dir_cluster, 
+				     find_mode, fd, image_buf, bpb);
+		} 
+		else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
+		{
+		    /* it's a volume */
+		    lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_UNLCK);
+		    errno = ENOENT;
+		    return NULL;
+		} 
+		else 
+		{
+		    /* assume it's a file */
+		    lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_UNLCK);
+		    return dirent;
+		}
+	    }
+	    dirent++;
+	}
+
+	/* we've reached the end of the cluster for this directory.
+	   Where's the next cluster? */
+	lock_dir(fd, (uint8_t*)(dirent - 1), image_buf, bpb, F_UNLCK);
+	if (cluster == 0) 
+	{
+	    // root dir is special: it carries straight on, but only
+	    // for bpbRootDirEnts entries
+	    entries += d / sizeof(struct direntry);
+	    if (entries >= bpb->bpbRootDirEnts)
+		break;
+	} 
+	else 
+	{
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	    if (!is_valid_cluster(cluster, bpb) || ++steps >= total_clusters)
+		break;
+	    dirent = (struct direntry*)cluster_to_addr(cluster, 
+						       image_buf, bpb);
+	}
+    }
+    errno = ENOENT;
+    return NULL;
+}
+
+
+/* the paths given to find_files, sorted into a trie of their
+   components */
+
+struct path_node
+{
+    char *name;			/* component, upper case */
+    int child;			/* first child, or -1 */
+    int last_child;		/* last child added, or -1 */
+    int sibling;		/* next child of our parent, or -1 */
+    int nchildren;
+    struct direntry *dirent;	/* what we matched, if anything */
+};
+
+struct path_req
+{
+    char key[MAXPATHLEN];	/* upper case, components split by \1 */
+    int index;			/* where it came from in paths */
+};
+
+
+static int cmp_path_req(const void *a, const void *b)
+{
+    return strcmp(((struct path_req *)a)->key, ((struct path_req *)b)->key);
+}
+
+
+static int cmp_path_node(const void *key, const void *elem)
+{
+    return strcmp((char *)key, (*(struct path_node **)elem)->name);
+}
+
+
+/* match the children of node against the directory at cluster, then
+   carry on down into any subdirectories they matched */
+static void resolve_node(struct path_node *nodes, int node, uint16_t cluster,
+			 int fd, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    struct path_node **children, **match;
+    struct direntry *dirent;
+    char fullname[13];
+    int i, c, n, steps = 0, done = 0;
+
+    /* the children were added in sorted order, so they can be
+       binary searched as they are */
+    children = malloc(nodes[node].nchildren * sizeof(struct path_node *));
+    for (i = 0, c = nodes[node].child; c >= 0; c = nodes[c].sibling)
+	children[i++] = &nodes[c];
+
+    while (!done) 
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	n = (cluster == MSDOSFSROOT) ? bpb->bpbRootDirEnts
+	    : (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) 
+	      / sizeof(struct direntry);
+	lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_RDLCK);
+	for (i = 0; i < n; i++, dirent++) 
+	{
+	    if (dirent->deName[0] == SLOT_EMPTY) 
+	    {
+		done = 1;
+		break;
+	    }
+	    if (dirent->deName[0] == SLOT_DELETED ||
+		(dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+	    get_name(fullname, dirent);
+	    for (c = 0; fullname[c] != '\0'; c++)
+		fullname[c] = toupper(fullname[c]);
+	    match = bsearch(fullname, children, nodes[node].nchildren,
+			    sizeof(struct path_node *), cmp_path_node);
+	    if (match != NULL && (*match)->dirent == NULL)
+		(*match)->dirent = dirent;
+	}
+	lock_dir(fd, cluster_to_addr(cluster, image_buf, bpb), 
+		 image_buf, bpb, F_UNLCK);
+
+	if (cluster == MSDOSFSROOT)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(cluster, bpb) || ++steps >= total_clusters)
+	    break;
+    }
+
+    for (i = 0; i < nodes[node].nchildren; i++) 
+    {
+	dirent = children[i]->dirent;
+	if (dirent != NULL && children[i]->child >= 0 &&
+	    (dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	    resolve_node(nodes, children[i] - nodes, 
+			 getushort(dirent->deStartCluster),
+			 fd, image_buf, bpb);
+    }
+    free(children);
+}
+
+
+/* find_files looks up many paths at once.  Rather than walking down
+   from the root for each path as find_file does, the paths are sorted
+   into a trie of their components, and the trie is matched against
+   the directory tree in one traversal: each directory on the way to
+   any of the paths is read once, however many of the paths go
+   through it.  found[i] is set to the entry for paths[i], or NULL if
+   it doesn't exist or isn't a file.  Returns how many were found.
+   Like find_file, each directory cluster is read under a shared lock
+   on fd. */
+
+int find_files(char **paths, int npaths, struct direntry **found, int fd,
+	       uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct path_req *reqs;
+    struct path_node *nodes;
+    int *leaf;
+    int nnodes = 1, cap = 64;
+    int i, j, node, nfound = 0;
+    char *p, *comp;
+
+    /* normalise the paths so sorting them groups them by component */
+    reqs = malloc(npaths * sizeof(struct path_req));
+    for (i = 0; i < npaths; i++) 
+    {
+	p = paths[i];
+	while (*p == '/' || *p == '\\')
+	    p++;
+	for (j = 0; *p != '\0' && j < MAXPATHLEN - 1; p++, j++) 
+	    reqs[i].key[j] = (*p == '/' || *p == '\\') ? '\1' : toupper(*p);
+	reqs[i].key[j] = '\0';
+	reqs[i].index = i;
+    }
+    qsort(reqs, npaths, sizeof(struct path_req), cmp_path_req);
+
+    /* build the trie.  Paths sharing a prefix are next to each other
+       now, so a component is either the last child added to its
+       parent or a new one. */
+    nodes = malloc(cap * sizeof(struct path_node));
+    memset(&nodes[0], 0, sizeof(struct path_node));
+    nodes[0].name = "";
+    nodes[0].child = nodes[0].last_child = nodes[0].sibling = -1;
+    leaf = malloc(npaths * sizeof(int));
+    for (i = 0; i < npaths; i++) 
+    {
+	node = 0;
+	for (comp = strtok(reqs[i].key, "\1"); comp != NULL; 
+	     comp = strtok(NULL, "\1")) 
+	{
+	    int last = nodes[node].last_child;
+	    if (last >= 0 && strcmp(nodes[last].name, comp) == 0) 
+	    {
+		node = last;
+		continue;
+	    }
+	    if (nnodes == cap) 
+	    {
+		cap *= 2;
+		nodes = realloc(nodes, cap * sizeof(struct path_node));
+	    }
+	    memset(&nodes[nnodes], 0, sizeof(struct path_node));
+	    nodes[nnodes].name = comp;
+	    nodes[nnodes].child = nodes[nnodes].last_child = -1;
+	    nodes[nnodes].sibling = -1;
+	    if (last >= 0)
+		nodes[last].sibling = nnodes;
+	    else
+		nodes[node].child = nnodes;
+	    nodes[node].last_child = nnodes;
+	    nodes[node].nchildren++;
+	    node = nnodes++;
+	}
+	leaf[reqs[i].index] = node;
+    }
+
+    if (nodes[0].child >= 0)
+	resolve_node(nodes, 0, MSDOSFSROOT, fd, image_buf, bpb);
+
+    for (i = 0; i < npaths; i++) 
+    {
+	struct direntry *dirent = nodes[leaf[i]].dirent;
+	if (leaf[i] == 0 || (dirent != NULL && 
+	    (dirent->deAttributes & ATTR_DIRECTORY) != 0))
+	    dirent = NULL;
+	found[i] = dirent;
+	if (dirent != NULL)
+	    nfound++;
+    }
+
+    free(leaf);
+    free(nodes);
+    free(reqs);
+    return nfound;
+}
+
+
+/* The directory iterator walks the whole tree depth first, handing
+   back one entry at a time, each directory's contents straight after
+   its own entry.  It keeps its own stack rather than recursing, so a
+   deep (or malicious) image can't blow the C stack, and the path
+   grows with it, so no directory is too deep to be gone into.  It
+   marks the clusters of the directories it is inside: a directory
+   that leads back into one of those - an ancestor - is handed back
+   with loop set and not gone into again, and a directory chain that
+   runs back on itself is cut off.  A directory reached twice some
+   other way (cross-linked) is walked both times.  While one directory
+   cluster is being read, the
+   next one is prefetched.  With fd >= 0 each cluster is locked shared
+   while it's being read.  Empty, deleted, "." and ".." and long
+   filename slots are skipped. */
+
+static void dir_iter_enter(struct dir_iter *it, struct dir_frame *f,
+			   uint16_t cluster)
+{
+    uint8_t *addr = cluster_to_addr(cluster, it->image_buf, it->bpb);
+    uint16_t next;
+
+    f->cluster = cluster;
+    f->index = (cluster != MSDOSFSROOT && (it->flags & DIR_ITER_CLUSTERS))
+	? -1 : 0;
+    if (cluster != MSDOSFSROOT) 
+    {
+	it->visited[cluster] = 1;
+	next = get_fat_entry(cluster, it->image_buf, it->bpb);
+	if (is_valid_cluster(next, it->bpb) && !it->visited[next])
+	    ra_hint(cluster_to_addr(next, it->image_buf, it->bpb),
+		    cluster_to_addr(next + 1, it->image_buf, it->bpb),
+		    MADV_WILLNEED);
+    }
+    if (it->fd >= 0)
+	lock_dir(it->fd, addr, it->image_buf, it->bpb, F_RDLCK);
+}
+
+
+static void dir_iter_leave(struct dir_iter *it, struct dir_frame *f)
+{
+    if (it->fd >= 0)
+	lock_dir(it->fd, cluster_to_addr(f->cluster, it->image_buf, it->bpb),
+		 it->image_buf, it->bpb, F_UNLCK);
+}
+
+
+/* start a frame for the directory at it->pending, below the entry
+   last handed back, making sure the path has room for its entries */
+static struct dir_frame *dir_iter_push(struct dir_iter *it)
+{
+    struct dir_frame *f;
+    int len = strlen(it->path);
+
+    if (it->depth == it->cap) 
+    {
+	it->cap *= 2;
+	it->stack = realloc(it->stack, it->cap * sizeof(struct dir_frame));
+    }
+    if (len + 1 + MAXFILENAME > it->pathcap) 
+    {
+	it->pathcap *= 2;
+	it->path = realloc(it->path, it->pathcap);
+    }
+    f = &it->stack[it->depth++];
+    f->pathlen = len;
+    it->path[f->pathlen++] = '/';
+    f->start = f->cluster = it->pending;
+    it->pending = 0;
+    return f;
+}
+
+
+/* pop the innermost frame, unmarking the clusters of its directory
+   that were gone through, so it can be walked again from elsewhere */
+static void dir_iter_pop(struct dir_iter *it)
+{
+    struct dir_frame *f = &it->stack[--it->depth];
+    uint32_t total_clusters = it->bpb->bpbSectors / it->bpb->bpbSecPerClust;
+    uint16_t cluster = f->start;
+    uint32_t steps = 0;
+
+    if (f->start == MSDOSFSROOT)
+	return;
+    while (cluster < total_clusters && steps++ < total_clusters) 
+    {
+	it->visited[cluster] = 0;
+	if (cluster == f->cluster || !is_valid_cluster(cluster, it->bpb))
+	    break;
+	cluster = get_fat_entry(cluster, it->image_buf, it->bpb);
+    }
+}
+
+
+void dir_iter_init(struct dir_iter *it, int flags, int fd,
+		   uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+
+    memset(it, 0, sizeof(struct dir_iter));
+    it->image_buf = image_buf;
+    it->bpb = bpb;
+    it->fd = fd;
+    it->flags = flags;
+    it->visited = calloc(total_clusters, 1);
+    it->pathcap = MAXPATHLEN;
+    it->path = calloc(it->pathcap, 1);
+    it->cap = 16;
+    it->stack = malloc(it->cap * sizeof(struct dir_frame));
+    it->depth = 1;
+    it->stack[0].pathlen = 0;
+    it->stack[0].start = MSDOSFSROOT;
+    dir_iter_enter(it, &it->stack[0], MSDOSFSROOT);
+}
+
+
+/* dir_iter_next fills in rec with the next entry and returns 1, or
+   returns 0 once the whole tree has been seen.  rec->path is only
+   good until the next call. */
+
+int dir_iter_next(struct dir_iter *it, struct dir_rec *rec)
+{
+    struct bpb33 *bpb = it->bpb;
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    struct dir_frame *f;
+    struct direntry *dirent;
+    uint16_t next;
+    int n;
+
+    if (it->tasks != NULL)
+	return dir_iter_next_tasks(it, rec);
+
+    if (it->pending) 
+    {
+	/* go into the directory we handed back last time */
+	f = dir_iter_push(it);
+	dir_iter_enter(it, f, f->start);
+    }
+
+    while (it->depth > 0) 
+    {
+	f = &it->stack[it->depth - 1];
+	n = (f->cluster == MSDOSFSROOT) ? bpb->bpbRootDirEnts
+	    : (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) 
+	      / sizeof(struct direntry);
+
+	if (f->index < 0) 
+	{
+	    /* the caller asked to hear about each directory cluster */
+	    f->index = 0;
+	    it->path[f->pathlen] = '\0';
+	    rec->path = it->path;
+	    rec->dirent = NULL;
+	    rec->depth = it->depth - 1;
+	    rec->cluster = f->cluster;
+	    rec->loop = 0;
+	    return 1;
+	}
+
+	if (f->index >= n) 
+	{
+	    /* on to the next cluster of this directory, or back up to
+	       the parent */
+	    dir_iter_leave(it, f);
+	    next = (f->cluster == MSDOSFSROOT) ? 0 
+		: get_fat_entry(f->cluster, it->image_buf, bpb);
+	    if (next < total_clusters && is_valid_cluster(next, bpb) && 
+		!it->visited[next])
+		dir_iter_enter(it, f, next);
+	    else
+		dir_iter_pop(it);
+	    continue;
+	}
+
+	dirent = (struct direntry*)cluster_to_addr(f->cluster, it->image_buf,
+						   bpb) + f->index++;
+	if (dirent->deName[0] == SLOT_EMPTY ||
+	    dirent->deName[0] == SLOT_DELETED ||
+	    dirent->deName[0] == '.' ||
+	    (dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+	    continue;
+
+	get_name(it->path + f->pathlen, dirent);
+	rec->path = it->path;
+	rec->dirent = dirent;
+	rec->depth = it->depth - 1;
+	rec->cluster = f->cluster;
+	rec->loop = 0;
+
+	if ((dirent->deAttributes & ATTR_DIRECTORY) != 0 &&
+	    (dirent->deAttributes & ATTR_HIDDEN) == 0) 
+	{
+	    next = getushort(dirent->deStartCluster);
+	    if (next >= total_clusters || !is_valid_cluster(next, bpb))
+		;
+	    else if (it->visited[next])
+		rec->loop = 1;
+	    else 
+	    {
+		it->pending = next;
+		ra_hint(cluster_to_addr(next, it->image_buf, bpb),
+			cluster_to_addr(next + 1, it->image_buf, bpb),
+			MADV_WILLNEED);
+	    }
+	}
+	return 1;
+    }
+    return 0;
+}
+
+
+/* The parallel walk.  dir_iter_init_parallel reads the tree with
+   several threads first: each directory is a task, and a thread that
+   finds subdirectories while reading one pushes them onto its own
+   deque, where idle threads can steal them from the other end.  Each
+   task keeps the clusters of its directory and the entries in each.
+   dir_iter_next then hands the entries back in exactly the order the
+   serial walk would, with the same loop and chain checks, so the
+   output doesn't depend on how the threads were scheduled. */
+
+struct dir_task
+{
+    uint16_t cluster;		/* first cluster, 0 for the root */
+    uint16_t *chain;		/* clusters of the directory */
+    int nchain;
+    int *first;			/* per chain cluster: its first entry */
+    struct direntry **ents;	/* entries worth handing back */
+    int nents;
+    int cap;
+};
+
+struct task_deque
+{
+    pthread_mutex_t lock;
+    struct dir_task **tasks;
+    int top;			/* thieves take from here */
+    int bottom;			/* the owner pushes and pops here */
+    int cap;
+};
+
+struct walk_pool
+{
+    struct dir_iter *it;
+    struct task_deque *deques;
+    int nthreads;
+    uint8_t *claimed;		/* directories that have a task */
+    int pending;		/* tasks pushed but not finished */
+};
+
+struct walk_worker
+{
+    struct walk_pool *pool;
+    int id;
+};
+
+
+static void deque_push(struct task_deque *dq, struct dir_task *t)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom == dq->cap) 
+    {
+	/* slide down over what's been stolen, or grow */
+	if (dq->top > 0) 
+	{
+	    memmove(dq->tasks, dq->tasks + dq->top, 
+		    (dq->bottom - dq->top) * sizeof(struct dir_task *));
+	    dq->bottom -= dq->top;
+	    dq->top = 0;
+	}
+	else 
+	{
+	    dq->cap = dq->cap ? dq->cap * 2 : 64;
+	    dq->tasks = realloc(dq->tasks, 
+				dq->cap * sizeof(struct dir_task *));
+	}
+    }
+    dq->tasks[dq->bottom++] = t;
+    pthread_mutex_unlock(&dq->lock);
+}
+
+
+static struct dir_task *deque_take(struct task_deque *dq, int steal)
+{
+    struct dir_task *t = NULL;
+
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top < dq->bottom)
+	t = steal ? dq->tasks[dq->top++] : dq->tasks[--dq->bottom];
+    pthread_mutex_unlock(&dq->lock);
+    return t;
+}
+
+
+/* read one directory: its chain, and the entries in each cluster */
+static void walk_scan(struct walk_pool *pool, int id, struct dir_task *t)
+{
+    struct dir_iter *it = pool->it;
+    struct bpb33 *bpb = it->bpb;
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    struct direntry *dirent;
+    struct dir_task *child;
+    uint16_t cluster = t->cluster, start;
+    int i, n;
+
+    while (1) 
+    {
+	t->chain = realloc(t->chain, (t->nchain + 1) * sizeof(uint16_t));
+	t->first = realloc(t->first, (t->nchain + 2) * sizeof(int));
+	t->chain[t->nchain] = cluster;
+	t->first[t->nchain] = t->nents;
+	t->nchain++;
+
+	dirent = (struct direntry*)cluster_to_addr(cluster, it->image_buf, 
+						   bpb);
+	n = (cluster == MSDOSFSROOT) ? bpb->bpbRootDirEnts
+	    : (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) 
+	      / sizeof(struct direntry);
+	if (it->fd >= 0)
+	    lock_dir(it->fd, (uint8_t*)dirent, it->image_buf, bpb, F_RDLCK);
+	for (i = 0; i < n; i++, dirent++) 
+	{
+	    if (dirent->deName[0] == SLOT_EMPTY ||
+		dirent->deName[0] == SLOT_DELETED ||
+		dirent->deName[0] == '.' ||
+		(dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+		continue;
+	    if (t->nents == t->cap) 
+	    {
+		t->cap = t->cap ? t->cap * 2 : 16;
+		t->ents = realloc(t->ents, 
+				  t->cap * sizeof(struct direntry *));
+	    }
+	    t->ents[t->nents++] = dirent;
+
+	    /* every directory gets read once, by whoever claims it */
+	    start = getushort(dirent->deStartCluster);
+	    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0 &&
+		(dirent->deAttributes & ATTR_HIDDEN) == 0 &&
+		start < total_clusters && is_valid_cluster(start, bpb) &&
+		__sync_bool_compare_and_swap(&pool->claimed[start], 0, 1)) 
+	    {
+		child = calloc(1, sizeof(struct dir_task));
+		child->cluster = start;
+		it->tasks[start] = child;
+		__sync_fetch_and_add(&pool->pending, 1);
+		deque_push(&pool->deques[id], child);
+	    }
+	}
+	if (it->fd >= 0)
+	    lock_dir(it->fd, cluster_to_addr(cluster, it->image_buf, bpb),
+		     it->image_buf, bpb, F_UNLCK);
+
+	if (cluster == MSDOSFSROOT)
+	    break;
+	cluster = get_fat_entry(cluster, it->image_buf, bpb);
+	if (cluster >= total_clusters || !is_valid_cluster(cluster, bpb) ||
+	    cluster == t->cluster || t->nchain >= total_clusters)
+	    break;
+    }
+    t->first[t->nchain] = t->nents;
+}
+
+
+static void *walk_thread(void *arg)
+{
+    struct walk_worker *w = arg;
+    struct walk_pool *pool = w->pool;
+    struct dir_task *t;
+    int i;
+
+    while (1) 
+    {
+	t = deque_take(&pool->deques[w->id], 0);
+	for (i = 1; t == NULL && i < pool->nthreads; i++)
+	    t = deque_take(&pool->deques[(w->id + i) % pool->nthreads], 1);
+	if (t != NULL) 
+	{
+	    walk_scan(pool, w->id, t);
+	    __sync_fetch_and_sub(&pool->pending, 1);
+	    continue;
+	}
+	if (__sync_fetch_and_add(&pool->pending, 0) == 0)
+	    break;
+	sched_yield();
+    }
+    return NULL;
+}
+
+
+void dir_iter_init_parallel(struct dir_iter *it, int flags, int nthreads,
+			    int fd, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    struct walk_pool pool;
+    struct walk_worker *workers;
+    pthread_t *threads;
+    int i, started;
+
+    if (nthreads <= 1) 
+    {
+	dir_iter_init(it, flags, fd, image_buf, bpb);
+	return;
+    }
+
+    memset(it, 0, sizeof(struct dir_iter));
+    it->image_buf = image_buf;
+    it->bpb = bpb;
+    it->fd = fd;
+    it->flags = flags;
+    it->visited = calloc(total_clusters, 1);
+    it->pathcap = MAXPATHLEN;
+    it->path = calloc(it->pathcap, 1);
+    it->tasks = calloc(total_clusters, sizeof(struct dir_task *));
+    it->tasks[MSDOSFSROOT] = calloc(1, sizeof(struct dir_task));
+
+    pool.it = it;
+    pool.nthreads = nthreads;
+    pool.claimed = calloc(total_clusters, 1);
+    pool.pending = 1;
+    pool.deques = calloc(nthreads, sizeof(struct task_deque));
+    for (i = 0; i < nthreads; i++)
+	pthread_mutex_init(&pool.deques[i].lock, NULL);
+    deque_push(&pool.deques[0], it->tasks[MSDOSFSROOT]);
+
+    /* a thread that doesn't start leaves its deque empty, and the
+       others steal from every deque, so the walk only needs one of
+       them - or, failing that, this thread */
+    workers = malloc(nthreads * sizeof(struct walk_worker));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (started = 0; started < nthreads; started++) 
+    {
+	workers[started].pool = &pool;
+	workers[started].id = started;
+	if (pthread_create(&threads[started], NULL, walk_thread, 
+			   &workers[started]) != 0)
+	    break;
+    }
+    if (started == 0)
+	walk_thread(&workers[0]);
+    for (i = 0; i < started; i++)
+	pthread_join(threads[i], NULL);
+
+    for (i = 0; i < nthreads; i++) 
+    {
+	pthread_mutex_destroy(&pool.deques[i].lock);
+	free(pool.deques[i].tasks);
+    }
+    free(pool.deques);
+    free(pool.claimed);
+    free(workers);
+    free(threads);
+
+    /* now merge, starting from the root's task */
+    it->cap = 16;
+    it->stack = malloc(it->cap * sizeof(struct dir_frame));
+    it->depth = 1;
+    memset(&it->stack[0], 0, sizeof(struct dir_frame));
+}
+
+
+/* dir_iter_next for a parallel walk: the same walk as the serial one,
+   but reading the tasks rather than the image */
+static int dir_iter_next_tasks(struct dir_iter *it, struct dir_rec *rec)
+{
+    uint32_t total_clusters = it->bpb->bpbSectors / it->bpb->bpbSecPerClust;
+    struct dir_frame *f;
+    struct dir_task *t;
+    struct direntry *dirent;
+    uint16_t next;
+    int i;
+
+    if (it->pending) 
+    {
+	f = dir_iter_push(it);
+	f->link = 0;
+	f->index = (it->flags & DIR_ITER_CLUSTERS) ? -1 : 0;
+	it->visited[f->cluster] = 1;
+    }
+
+    while (it->depth > 0) 
+    {
+	f = &it->stack[it->depth - 1];
+	t = it->tasks[f->start];
+
+	if (f->index < 0) 
+	{
+	    f->index = 0;
+	    it->path[f->pathlen] = '\0';
+	    rec->path = it->path;
+	    rec->dirent = NULL;
+	    rec->depth = it->depth - 1;
+	    rec->cluster = f->cluster;
+	    rec->loop = 0;
+	    return 1;
+	}
+
+	if (t == NULL || 
+	    f->index >= t->first[f->link + 1] - t->first[f->link]) 
+	{
+	    if (t != NULL && f->link + 1 < t->nchain &&
+		!it->visited[t->chain[f->link + 1]]) 
+	    {
+		f->link++;
+		f->cluster = t->chain[f->link];
+		f->index = (it->flags & DIR_ITER_CLUSTERS) ? -1 : 0;
+		it->visited[f->cluster] = 1;
+	    }
+	    else 
+	    {
+		/* as dir_iter_pop, but the chain is in the task */
+		for (i = 0; t != NULL && f->start != MSDOSFSROOT && 
+			    i <= f->link; i++)
+		    it->visited[t->chain[i]] = 0;
+		it->depth--;
+	    }
+	    continue;
+	}
+
+	dirent = t->ents[t->first[f->link] + f->index++];
+	get_name(it->path + f->pathlen, dirent);
+	rec->path = it->path;
+	rec->dirent = dirent;
+	rec->depth = it->depth - 1;
+	rec->cluster = f->cluster;
+	rec->loop = 0;
+
+	if ((dirent->deAttributes & ATTR_DIRECTORY) != 0 &&
+	    (dirent->deAttributes & ATTR_HIDDEN) == 0) 
+	{
+	    next = getushort(dirent->deStartCluster);
+	    if (next >= total_clusters || it->tasks[next] == NULL)
+		;
+	    else if (it->visited[next])
+		rec->loop = 1;
+	    else
+		it->pending = next;
+	}
+	return 1;
+    }
+    return 0;
+}
+
+
+/* dir_iter_finish drops any locks still held (if the caller stopped
+   early) and frees the iterator */
+void dir_iter_finish(struct dir_iter *it)
+{
+    uint32_t total_clusters = it->bpb->bpbSectors / it->bpb->bpbSecPerClust;
+    uint32_t i;
+
+    if (it->tasks != NULL) 
+    {
+	/* a parallel walk holds no locks by now */
+	for (i = 0; i < total_clusters; i++) 
+	{
+	    if (it->tasks[i] == NULL)
+		continue;
+	    free(it->tasks[i]->chain);
+	    free(it->tasks[i]->first);
+	    free(it->tasks[i]->ents);
+	    free(it->tasks[i]);
+	}
+	free(it->tasks);
+	it->depth = 0;
+    }
+    while (it->depth > 0)
+	dir_iter_leave(it, &it->stack[--it->depth]);
+    free(it->stack);
+    free(it->visited);
+    free(it->path);
+}
+
+/* write the values into a directory entry */
+void write_dirent(struct direntry *dirent, char *filename, 
+		  uint16_t start_cluster, uint32_t size)
+{
+    char *p, *p2;
+    char *uppername;
+    int len, i;
+
+    /* clean out anything old that used to be here */
+    memset(dirent, 0, sizeof(struct direntry));
+
+    /* extract just the filename part */
+    uppername = strdup(filename);
+    p2 = uppername;
+    for (i = 0; i < strlen(filename); i++) 
+    {
+	if (p2[i] == '/' || p2[i] == '\\') 
+	{
+	    uppername = p2+i+1;
+	}
+    }
+
+    /* convert filename to upper case */
+    for (i = 0; i < strlen(uppername); i++) 
+    {
+	uppername[i] = toupper(uppername[i]);
+    }
+
+    /* set the file name and extension */
+    memset(dirent->deName, ' ', 8);
+    p = strchr(uppername, '.');
+    memcpy(dirent->deExtension, "___", 3);
+    if (p == NULL) 
+    {
+	fprintf(stderr, "No filename extension given - defaulting to .___\n");
+    }
+    else 
+    {
+	*p = '\0';
+	p++;
+	len = strlen(p);
+	if (len > 3) len = 3;
+	memcpy(dirent->deExtension, p, len);
+    }
+
+    if (strlen(uppername)>8) 
+    {
+	uppername[8]='\0';
+    }
+    memcpy(dirent->deName, uppername, strlen(uppername));
+    free(p2);
+
+    /* set the attributes and file size */
+    dirent->deAttributes = ATTR_NORMAL;
+    putushort(dirent->deStartCluster, start_cluster);
+    putulong(dirent->deFileSize, size);
+
+    /* could also set time and date here if we really
+       cared... */
+}
+
+
+/* addr_to_cluster returns the cluster that addr lies in, or 0
+   (MSDOSFSROOT) if it's in the root directory */
+uint16_t addr_to_cluster(uint8_t *addr, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint8_t *root = root_dir_addr(image_buf, bpb);
+    uint8_t *data = root + bpb->bpbRootDirEnts * sizeof(struct direntry);
+
+    if (addr < data)
+	return MSDOSFSROOT;
+    return CLUST_FIRST + 
+	(addr - data) / (bpb->bpbBytesPerSec * bpb->bpbSecPerClust);
+}
+
+
+/* Each directory we create entries in gets an index of its free
+   slots, built by one scan of the directory.  Creating an entry just
+   takes the next slot off the index, so filling a big directory
+   doesn't rescan it from the top every time.  The index lives for the
+   life of the process; delete_dirent() throws it away. */
+
+#define DIR_INDEX_SIZE 8
+
+struct dir_slots
+{
+    int valid;
+    uint16_t cluster;		/* first cluster of the directory */
+    uint16_t last_cluster;	/* last cluster of its chain */
+    struct direntry **free;	/* free slots, in directory order */
+    int nfree;
+    int cap;
+    int next;			/* next slot in free to hand out */
+    struct direntry *end;	/* first never-used slot, if any */
+};
+
+static struct dir_slots dir_index[DIR_INDEX_SIZE];
+static int dir_index_next = 0;
+
+
+static void dir_slots_add(struct dir_slots *ds, struct direntry *slot)
+{
+    if (ds->nfree == ds->cap) 
+    {
+	ds->cap = ds->cap ? ds->cap * 2 : 32;
+	ds->free = realloc(ds->free, ds->cap * sizeof(struct direntry *));
+    }
+    ds->free[ds->nfree++] = slot;
+}
+
+
+/* scan a directory and record its free slots */
+static void dir_slots_build(struct dir_slots *ds, uint16_t cluster,
+			    uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    struct direntry *dirent;
+    int i, n, steps = 0;
+
+    ds->valid = 1;
+    ds->cluster = cluster;
+    ds->last_cluster = cluster;
+    ds->nfree = ds->next = 0;
+    ds->end = NULL;
+
+    while (1) 
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	n = (cluster == MSDOSFSROOT) ? bpb->bpbRootDirEnts
+	    : (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) 
+	      / sizeof(struct direntry);
+	for (i = 0; i < n; i++, dirent++) 
+	{
+	    /* everything after the first never-used slot is free */
+	    if (ds->end == NULL && dirent->deName[0] == SLOT_EMPTY)
+		ds->end = dirent;
+	    if (ds->end != NULL || dirent->deName[0] == SLOT_DELETED)
+		dir_slots_add(ds, dirent);
+	}
+
+	if (cluster == MSDOSFSROOT)
+	    break;
+	ds->last_cluster = cluster;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(cluster, bpb) || ++steps >= total_clusters)
+	    break;
+    }
+}
+
+
+static struct dir_slots *dir_slots_get(uint16_t cluster, uint8_t *image_buf,
+				       struct bpb33 *bpb)
+{
+    struct dir_slots *ds;
+    int i;
+
+    for (i = 0; i < DIR_INDEX_SIZE; i++) 
+    {
+	if (dir_index[i].valid && dir_index[i].cluster == cluster)
+	    return &dir_index[i];
+    }
+    ds = &dir_index[dir_index_next];
+    dir_index_next = (dir_index_next + 1) % DIR_INDEX_SIZE;
+    dir_slots_build(ds, cluster, image_buf, bpb);
+    return ds;
+}
+
+
+/* add a zeroed cluster to the end of a directory.  The root
+   directory has a fixed size, so it can't grow. */
+static int dir_slots_grow(struct dir_slots *ds, uint8_t *image_buf,
+			  struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    struct direntry *dirent;
+    uint16_t cluster;
+    int i;
+
+    if (ds->cluster == MSDOSFSROOT)
+	return -1;
+    cluster = find_free_near(ds->last_cluster + 1, image_buf, bpb);
+    if (cluster == 0)
+	return -1;
+
+    memset(cluster_to_addr(cluster, image_buf, bpb), 0, clust_size);
+    set_fat_entry(cluster, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+    set_fat_entry(ds->last_cluster, cluster, image_buf, bpb);
+    ds->last_cluster = cluster;
+
+    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    if (ds->end == NULL)
+	ds->end = dirent;
+    for (i = 0; i < clust_size / sizeof(struct direntry); i++)
+	dir_slots_add(ds, dirent + i);
+    return 0;
+}
+
+
+/* reserve_dirents makes sure the directory starting at dir has at
+   least n free slots, growing it if it must.  Returns 0, or -1 if
+   there isn't room.  The caller should hold the FAT lock. */
+int reserve_dirents(struct direntry *dir, int n,
+		    uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct dir_slots *ds;
+
+    ds = dir_slots_get(addr_to_cluster((uint8_t*)dir, image_buf, bpb),
+		       image_buf, bpb);
+    while (ds->nfree - ds->next < n) 
+    {
+	if (dir_slots_grow(ds, image_buf, bpb) < 0)
+	    return -1;
+    }
+    return 0;
+}
+
+
+/* create_dirent finds a free slot in the directory whose first entry
+   is dir, growing the directory by a cluster if it's full, and writes
+   the directory entry.  It returns the new entry, or NULL if there's
+   no room.  Growing touches the FAT, so the caller should hold the
+   FAT lock as well as the directory's. */
+
+struct direntry *create_dirent(struct direntry *dir, char *filename, 
+			       uint16_t start_cluster, uint32_t size,
+			       uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+
+    dirent = take_dirent(dir, image_buf, bpb);
+    if (dirent != NULL)
+	write_dirent(dirent, filename, start_cluster, size);
+    return dirent;
+}
+
+
+/* take the next free slot in a directory, as create_dirent does,
+   leaving it to the caller to fill in */
+static struct direntry *take_dirent(struct direntry *dir,
+				    uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct dir_slots *ds;
+    struct direntry *dirent;
+
+    if (reserve_dirents(dir, 1, image_buf, bpb) < 0)
+	return NULL;
+    ds = dir_slots_get(addr_to_cluster((uint8_t*)dir, image_buf, bpb),
+		       image_buf, bpb);
+    dirent = ds->free[ds->next++];
+
+    if (dirent == ds->end) 
+    {
+	/* we're using up the never-used part of the directory; make
+	   sure the next slot still marks where it starts, just in
+	   case it wasn't zeroed before */
+	ds->end = NULL;
+	if (ds->next < ds->nfree) 
+	{
+	    ds->end = ds->free[ds->next];
+	    memset((uint8_t*)ds->end, 0, sizeof(struct direntry));
+	    ds->end->deName[0] = SLOT_EMPTY;
+	}
+    }
+    return dirent;
+}
+
+
+/* delete_dirent marks a directory entry as deleted.  Its slot is
+   free for reuse, so the free-slot indexes are rebuilt next time. */
+void delete_dirent(struct direntry *dirent)
+{
+    int i;
+
+    dirent->deName[0] = SLOT_DELETED;
+    for (i = 0; i < DIR_INDEX_SIZE; i++) 
+    {
+	free(dir_index[i].free);
+	memset(&dir_index[i], 0, sizeof(struct dir_slots));
+    }
+}
+
+
+/* lock_dir_chain locks every cluster of the directory starting at
+   cluster (or the whole root directory).  The FAT lock should already
+   be held so the chain can't change under us. */
+int lock_dir_chain(int fd, uint16_t cluster, uint8_t *image_buf,
+		   struct bpb33 *bpb, short type)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    int steps = 0;
+
+    if (cluster == MSDOSFSROOT) 
+	return lock_dir(fd, root_dir_addr(image_buf, bpb), image_buf, bpb, 
+			type);
+    while (is_valid_cluster(cluster, bpb) && steps++ < total_clusters) 
+    {
+	if (lock_dir(fd, cluster_to_addr(cluster, image_buf, bpb), 
+		     image_buf, bpb, type) < 0)
+	    return -1;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    return 0;
+}
+
+
+/* write a directory entry for a subdirectory, or a "." or ".." entry.
+   Directory names have no extension, so this doesn't go through
+   write_dirent. */
+void write_dir_dirent(struct direntry *dirent, char *name,
+		      uint16_t start_cluster)
+{
+    int i;
+
+    memset(dirent, 0, sizeof(struct direntry));
+    memset(dirent->deName, ' ', 8);
+    memset(dirent->deExtension, ' ', 3);
+    for (i = 0; i < 8 && name[i] != '\0'; i++)
+	dirent->deName[i] = toupper(name[i]);
+    dirent->deAttributes = ATTR_DIRECTORY;
+    putushort(dirent->deStartCluster, start_cluster);
+}
+
+
+/* look up one name in the directory starting at cluster.  Unlike
+   find_file this doesn't follow paths, and it returns directories. */
+static struct direntry *dir_lookup(uint16_t cluster, char *name,
+				   uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    struct direntry *dirent;
+    char fullname[13];
+    int i, n, steps = 0;
+
+    while (1) 
+    {
+	dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+	n = (cluster == MSDOSFSROOT) ? bpb->bpbRootDirEnts
+	    : (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) 
+	      / sizeof(struct direntry);
+	for (i = 0; i < n; i++, dirent++) 
+	{
+	    if (dirent->deName[0] == SLOT_EMPTY)
+		return NULL;
+	    if (dirent->deName[0] == SLOT_DELETED ||
+		(dirent->deAttributes & ATTR_VOLUME) != 0)
+		continue;
+	    get_name(fullname, dirent);
+	    if (strcasecmp(fullname, name) == 0)
+		return dirent;
+	}
+
+	if (cluster == MSDOSFSROOT)
+	    return NULL;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(cluster, bpb) || ++steps >= total_clusters)
+	    return NULL;
+    }
+}
+
+
+/* make_dir creates the directory path.  With parents set, any missing
+   directories along the way are made too, and it's not an error if
+   the directory already exists.
+
+   The path is resolved once, down to the first component that's
+   missing.  Clusters for everything below that are claimed up front,
+   then each new directory is zeroed and given its "." and ".."
+   entries, with the entry for its child written straight into its
+   first free slot - a directory we just made has nothing to look
+   up.  Only then is the top new directory linked into the existing
+   tree, so other tools see either none of the new path or all of it,
+   and if the disk is full nothing is changed.  Returns 0, or -1 after
+   printing why not. */
+
+int make_dir(char *path, int parents, int fd,
+	     uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    char buf[MAXPATHLEN];
+    char *names[MAXPATHLEN / 2];
+    uint16_t clusters[MAXPATHLEN / 2];
+    uint16_t parent = MSDOSFSROOT;
+    struct direntry *dirent, *top;
+    char *p;
+    int i, j, n = 0, first;
+    int status = 0;
+
+    /* split the path into its components */
+    strncpy(buf, path, MAXPATHLEN - 1);
+    buf[MAXPATHLEN - 1] = '\0';
+    for (p = strtok(buf, "/\\"); p != NULL; p = strtok(NULL, "/\\")) 
+    {
+	if (strlen(p) > 8 || strchr(p, '.') != NULL) 
+	{
+	    fprintf(stderr, "Bad directory name %s: names are up to 8 "
+		    "characters with no extension\n", p);
+	    return -1;
+	}
+	names[n++] = p;
+    }
+    if (n == 0) 
+    {
+	fprintf(stderr, "No directory name given\n");
+	return -1;
+    }
+
+    if (lock_fat(fd, bpb, F_WRLCK) < 0)
+	return -1;
+
+    /* walk down as far as the path already exists */
+    for (first = 0; first < n; first++) 
+    {
+	lock_dir_chain(fd, parent, image_buf, bpb, F_RDLCK);
+	dirent = dir_lookup(parent, names[first], image_buf, bpb);
+	lock_dir_chain(fd, parent, image_buf, bpb, F_UNLCK);
+	if (dirent == NULL)
+	    break;
+	if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) 
+	{
+	    fprintf(stderr, "%s exists and is not a directory\n", 
+		    names[first]);
+	    status = -1;
+	    goto out;
+	}
+	parent = getushort(dirent->deStartCluster);
+    }
+
+    if (first == n) 
+    {
+	if (!parents) 
+	{
+	    fprintf(stderr, "%s already exists\n", path);
+	    status = -1;
+	}
+	goto out;
+    }
+    if (!parents && first != n - 1) 
+    {
+	fprintf(stderr, "No directory called %s exists\n", names[first]);
+	status = -1;
+	goto out;
+    }
+
+    /* claim a cluster for each new directory, keeping them together
+       after the parent, then make room in the existing parent.  The
+       parent is grown last so that running out of space leaves it
+       as it was; only our own clusters need giving back. */
+    for (i = first; i < n; i++) 
+    {
+	clusters[i] = find_free_near(i == first ? parent + 1 
+				     : clusters[i - 1] + 1, 
+				     image_buf, bpb);
+	if (clusters[i] == 0) 
+	{
+	    fprintf(stderr, "Disk is full\n");
+	    for (j = first; j < i; j++)
+		set_fat_entry(clusters[j], CLUST_FREE, image_buf, bpb);
+	    status = -1;
+	    goto out;
+	}
+	set_fat_entry(clusters[i], FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+    }
+    top = (struct direntry*)cluster_to_addr(parent, image_buf, bpb);
+    if (reserve_dirents(top, 1, image_buf, bpb) < 0) 
+    {
+	fprintf(stderr, "No room in the directory for %s\n", names[first]);
+	for (j = first; j < n; j++)
+	    set_fat_entry(clusters[j], CLUST_FREE, image_buf, bpb);
+	status = -1;
+	goto out;
+    }
+
+    /* fill in the new directories from the bottom up */
+    for (i = n - 1; i >= first; i--) 
+    {
+	dirent = (struct direntry*)cluster_to_addr(clusters[i], 
+						   image_buf, bpb);
+	memset(dirent, 0, clust_size);
+	write_dir_dirent(&dirent[0], ".", clusters[i]);
+	write_dir_dirent(&dirent[1], "..", 
+			 i == first ? parent : clusters[i - 1]);
+	if (i < n - 1)
+	    write_dir_dirent(&dirent[2], names[i + 1], clusters[i + 1]);
+    }
+
+    /* and hook the new subtree into the existing one */
+    if (lock_dir_chain(fd, parent, image_buf, bpb, F_WRLCK) < 0) 
+    {
+	lock_dir_chain(fd, parent, image_buf, bpb, F_UNLCK);
+	for (j = first; j < n; j++)
+	    set_fat_entry(clusters[j], CLUST_FREE, image_buf, bpb);
+	status = -1;
+	goto out;
+    }
+    dirent = take_dirent(top, image_buf, bpb);
+    write_dir_dirent(dirent, names[first], clusters[first]);
+    lock_dir_chain(fd, parent, image_buf, bpb, F_UNLCK);
+
+ out:
+    lock_fat(fd, bpb, F_UNLCK);
+    return status;
+}
+
+
+/* Byte-range locks on the image file let several tools work on one
+   image at once.  The FAT is locked as a whole: readers that follow
+   chains hold it shared, and anything that allocates or frees
+   clusters holds it exclusive.  The root directory and each
+   directory cluster are locked on their own, shared while entries
+   are read and exclusive while they're changed.  These are fcntl
+   locks, so they're per process: threads of one tool share them.
+   Every tool that adds or removes directory entries takes the FAT
+   lock first, so holding it exclusive also keeps the directory tree
+   still.  The lock functions return 0, or -1 if the lock couldn't be
+   had - for instance EDEADLK, or a filesystem that can't lock - in
+   which case anything that was going to write must give up. */
+
+int lock_range(int fd, off_t start, off_t len, short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    while (fcntl(fd, F_SETLKW, &fl) < 0) 
+    {
+	if (errno == EINTR)
+	    continue;
+	if (type != F_UNLCK)
+	    fprintf(stderr, "Cannot lock disk image: %s\n", strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+
+/* lock_fat locks all copies of the FAT */
+int lock_fat(int fd, struct bpb33 *bpb, short type)
+{
+    return lock_range(fd, bpb->bpbResSectors * bpb->bpbBytesPerSec,
+		      bpb->bpbFATs * bpb->bpbFATsecs * bpb->bpbBytesPerSec, 
+		      type);
+}
+
+
+/* lock_dir locks the piece of directory that addr lies in: the whole
+   root directory, or a single cluster of any other directory */
+int lock_dir(int fd, uint8_t *addr, uint8_t *image_buf, struct bpb33 *bpb,
+	     short type)
+{
+    uint8_t *root = root_dir_addr(image_buf, bpb);
+    uint32_t root_size = bpb->bpbRootDirEnts * sizeof(struct direntry);
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+
+    if (addr >= root && addr < root + root_size) 
+    {
+	return lock_range(fd, root - image_buf, root_size, type);
+    }
+    else 
+    {
+	uint8_t *data = root + root_size;
+	uint32_t n = (addr - data) / clust_size;
+	return lock_range(fd, (data - image_buf) + n * clust_size, 
+			  clust_size, type);
+    }
+}
+
+
+/* lock_image locks the whole image, for tools like scandisk that may
+   touch any part of it */
+int lock_image(int fd, short type)
+{
+    return lock_range(fd, 0, 0, type);
+}
+
+/* The cluster allocator keeps a bitmap of free clusters (bit set
+   means free) built from one pass over the FAT, and splits the
+   cluster range into allocation groups.  Each thread allocates from
+   its own group, so threads don't fight over the same words, and a
+   cluster is claimed by atomically clearing its bit.  When a group
+   runs dry the thread moves on to its neighbours' groups. */
+
+void alloc_init(struct cluster_alloc *alloc, int ngroups,
+		uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t i, nwords;
+
+    if (ngroups < 1)
+	ngroups = 1;
+    /* only clusters that have a data area behind them; the FAT has
+       entries for a few more */
+    alloc->total_clusters = data_clusters(bpb) + CLUST_FIRST;
+    alloc->ngroups = ngroups;
+    nwords = (alloc->total_clusters + 63) / 64;
+    alloc->free_map = calloc(nwords, sizeof(uint64_t));
+    alloc->cursor = malloc(ngroups * sizeof(uint32_t));
+
+    for (i = CLUST_FIRST; i < alloc->total_clusters; i++) 
+    {
+	if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE)
+	    alloc->free_map[i / 64] |= (uint64_t)1 << (i % 64);
+    }
+    for (i = 0; i < ngroups; i++)
+	alloc->cursor[i] = alloc_group_start(alloc, i);
+}
+
+
+void alloc_destroy(struct cluster_alloc *alloc)
+{
+    free(alloc->free_map);
+    free(alloc->cursor);
+}
+
+
+/* first cluster of allocation group */
+uint32_t alloc_group_start(struct cluster_alloc *alloc, int group)
+{
+    uint32_t span = alloc->total_clusters - CLUST_FIRST;
+    return CLUST_FIRST + (uint32_t)((uint64_t)span * group / alloc->ngroups);
+}
+
+
+/* try to claim a free cluster in [from, to); returns 0 if there's none */
+static uint16_t alloc_claim_range(struct cluster_alloc *alloc,
+				  uint32_t from, uint32_t to)
+{
+    uint32_t i = from;
+
+    while (i < to)
+    {
+	uint64_t *word = &alloc->free_map[i / 64];
+	uint64_t bits = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+	/* ignore clusters below i, and past the end of the range */
+	bits &= ~(uint64_t)0 << (i % 64);
+	if (to - (i - i % 64) < 64)
+	    bits &= ((uint64_t)1 << (to % 64)) - 1;
+
+	while (bits != 0)
+	{
+	    int bit = __builtin_ctzll(bits);
+	    uint64_t mask = (uint64_t)1 << bit;
+	    if (__atomic_fetch_and(word, ~mask, __ATOMIC_ACQ_REL) & mask)
+		return (i - i % 64) + bit;
+	    /* somebody else got there first */
+	    bits &= ~mask;
+	}
+	i = i - i % 64 + 64;
+    }
+    return 0;
+}
+
+
+/* alloc_cluster claims a free cluster for the caller, preferring
+   group.  It returns 0 when the filesystem is full.  The caller still
+   has to mark the cluster as used in the FAT. */
+uint16_t alloc_cluster(struct cluster_alloc *alloc, int group)
+{
+    int g, n;
+    uint16_t cluster;
+
+    for (n = 0; n < alloc->ngroups; n++)
+    {
+	uint32_t end;
+
+	g = (group + n) % alloc->ngroups;
+	end = alloc_group_start(alloc, g + 1);
+
+	/* only the group's owner moves its cursor, but anyone may
+	   steal clusters from it */
+	cluster = alloc_claim_range(alloc, n == 0 ? alloc->cursor[g]
+				    : alloc_group_start(alloc, g), end);
+	if (cluster != 0)
+	{
+	    if (n == 0)
+		alloc->cursor[g] = cluster + 1;
+	    return cluster;
+	}
+    }
+
+    /* clusters released behind our cursor are still fair game */
+    return alloc_claim_range(alloc, alloc_group_start(alloc, group),
+			     alloc->cursor[group]);
+}
+
+
+/* alloc_release hands a cluster back to the allocator */
+void alloc_release(struct cluster_alloc *alloc, uint16_t cluster)
+{
+    __atomic_fetch_or(&alloc->free_map[cluster / 64],
+		      (uint64_t)1 << (cluster % 64), __ATOMIC_ACQ_REL);
+}
+
+/* collect_chain appends the clusters of the chain starting at cluster
+   to *list (which has room for *cap entries, and is grown as needed),
+   and returns how many it added.  It gives up after as many steps as
+   there are clusters, so a looped chain can't run forever. */
+int collect_chain(uint16_t cluster, uint16_t **list, int *n, int *cap,
+		  uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    int start = *n;
+
+    while (is_valid_cluster(cluster, bpb) && *n - start < total_clusters)
+    {
+	if (*n == *cap)
+	{
+	    *cap = *cap ? *cap * 2 : 64;
+	    *list = realloc(*list, *cap * sizeof(uint16_t));
+	}
+	(*list)[(*n)++] = cluster;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    return *n - start;
+}
+
+
+/* count_fragments returns how many contiguous runs the chain starting
+   at cluster is split into (0 for an empty chain), and if nclusters
+   isn't NULL, how many clusters there are in it */
+int count_fragments(uint16_t cluster, uint32_t *nclusters,
+		    uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    uint16_t next;
+    int runs = 0, steps = 0;
+
+    if (nclusters != NULL)
+	*nclusters = 0;
+    if (!is_valid_cluster(cluster, bpb))
+	return 0;
+    runs = 1;
+    while (++steps < total_clusters)
+    {
+	next = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(next, bpb))
+	    break;
+	if (next != cluster + 1)
+	    runs++;
+	cluster = next;
+    }
+    if (nclusters != NULL)
+	*nclusters = steps;
+    return runs;
+}
+
+
+static int cmp_cluster(const void *a, const void *b)
+{
+    return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+
+/* free_clusters marks every cluster in list free.  The list is sorted
+   first so the FAT is updated in one forward sweep however the chains
+   were laid out, and each cluster goes back to alloc (if there is
+   one) so the allocator never has to rescan the FAT. */
+void free_clusters(uint16_t *list, int n, struct cluster_alloc *alloc,
+		   uint8_t *image_buf, struct bpb33 *bpb)
+{
+    int i;
+
+    qsort(list, n, sizeof(uint16_t), cmp_cluster);
+    for (i = 0; i < n; i++)
+    {
+	/* a cross-linked cluster can show up twice */
+	if (i > 0 && list[i] == list[i - 1])
+	    continue;
+	set_fat_entry(list[i], CLUST_FREE, image_buf, bpb);
+	if (alloc != NULL)
+	    alloc_release(alloc, list[i]);
+    }
+}
+
+
+/* resize_chain makes the cluster chain of dirent exactly nclusters
+   long, freeing clusters off the end or appending zeroed ones.  A
+   chain that is already the right length is left alone.  If alloc is
+   NULL and the chain has to grow, a private allocator is built.
+   Returns 0, or -1 if the disk filled up (the chain is unchanged).
+   The caller should hold the FAT lock. */
+int resize_chain(struct direntry *dirent, uint32_t nclusters,
+		 struct cluster_alloc *alloc,
+		 uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint16_t cluster = getushort(dirent->deStartCluster);
+    uint16_t last = 0;
+    uint32_t count = 0;
+    uint16_t *list = NULL;
+    int n = 0, cap = 0;
+
+    /* walk the part of the chain we're keeping */
+    while (count < nclusters && is_valid_cluster(cluster, bpb))
+    {
+	last = cluster;
+	count++;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+
+    if (count == nclusters)
+    {
+	/* cut the chain here, and free whatever followed */
+	if (is_valid_cluster(cluster, bpb))
+	{
+	    collect_chain(cluster, &list, &n, &cap, image_buf, bpb);
+	    if (last == 0)
+		putushort(dirent->deStartCluster, 0);
+	    else
+		set_fat_entry(last, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+	    free_clusters(list, n, alloc, image_buf, bpb);
+	    free(list);
+	}
+	return 0;
+    }
+    else
+    {
+	/* grow the chain */
+	struct cluster_alloc private_alloc;
+	uint16_t old_last = last;
+	uint16_t new_cluster;
+
+	if (alloc == NULL)
+	{
+	    alloc = &private_alloc;
+	    alloc_init(alloc, 1, image_buf, bpb);
+	}
+
+	for ( ; count < nclusters; count++)
+	{
+	    new_cluster = alloc_cluster(alloc, 0);
+	    if (new_cluster == 0)
+	    {
+		/* out of space - put things back the way they were */
+		if (old_last == 0)
+		    putushort(dirent->deStartCluster, 0);
+		else
+		    set_fat_entry(old_last, FAT12_MASK & CLUST_EOFS, 
+				  image_buf, bpb);
+		free_clusters(list, n, alloc, image_buf, bpb);
+		free(list);
+		if (alloc == &private_alloc)
+		    alloc_destroy(alloc);
+		return -1;
+	    }
+	    if (n == cap)
+	    {
+		cap = cap ? cap * 2 : 64;
+		list = realloc(list, cap * sizeof(uint16_t));
+	    }
+	    list[n++] = new_cluster;
+
+	    memset(cluster_to_addr(new_cluster, image_buf, bpb), 0, clust_size);
+	    set_fat_entry(new_cluster, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+	    if (last == 0)
+		putushort(dirent->deStartCluster, new_cluster);
+	    else
+		set_fat_entry(last, new_cluster, image_buf, bpb);
+	    last = new_cluster;
+	}
+	free(list);
+	if (alloc == &private_alloc)
+	    alloc_destroy(alloc);
+	return 0;
+    }
+}
+
+
+/* truncate_file sets the size of the file to size, dropping clusters
+   it no longer needs or zero-filling the new space.  Returns 0, or -1
+   if there wasn't room to grow it. */
+int truncate_file(struct direntry *dirent, uint32_t size,
+		  struct cluster_alloc *alloc,
+		  uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t old_size = getulong(dirent->deFileSize);
+    uint32_t nclusters = (size + clust_size - 1) / clust_size;
+
+    if (resize_chain(dirent, nclusters, alloc, image_buf, bpb) < 0)
+	return -1;
+
+    if (size > old_size && old_size % clust_size != 0)
+    {
+	/* the old last cluster has junk past the old end of file */
+	uint16_t cluster = getushort(dirent->deStartCluster);
+	uint32_t i;
+	for (i = 1; i < (old_size + clust_size - 1) / clust_size; i++)
+	    cluster = get_fat_entry(cluster, image_buf, bpb);
+	memset(cluster_to_addr(cluster, image_buf, bpb) + old_size % clust_size,
+	       0, clust_size - old_size % clust_size);
+    }
+    putulong(dirent->deFileSize, size);
+    return 0;
+}
+
+/* Appends find the end of a file from a small cache of recently
+   appended-to files, keyed by starting cluster.  An entry is only
+   trusted if the file size still matches what we recorded, so any
+   other change to the file makes us walk the chain again. */
+
+#define TAIL_CACHE_SIZE 16
+
+struct tail_entry
+{
+    uint16_t start;		/* first cluster of the file */
+    uint16_t tail;		/* last cluster of the file */
+    uint32_t size;		/* file size when tail was recorded */
+};
+
+static struct tail_entry tail_cache[TAIL_CACHE_SIZE];
+static int tail_cache_next = 0;
+
+
+static void tail_cache_store(uint16_t start, uint16_t tail, uint32_t size)
+{
+    int i;
+
+    for (i = 0; i < TAIL_CACHE_SIZE; i++) 
+    {
+	if (tail_cache[i].start == start) 
+	    break;
+    }
+    if (i == TAIL_CACHE_SIZE) 
+    {
+	i = tail_cache_next;
+	tail_cache_next = (tail_cache_next + 1) % TAIL_CACHE_SIZE;
+    }
+    tail_cache[i].start = start;
+    tail_cache[i].tail = tail;
+    tail_cache[i].size = size;
+}
+
+
+/* find_tail returns the last cluster of the file, or 0 if it has none */
+uint16_t find_tail(struct direntry *dirent, uint8_t *image_buf,
+		   struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint16_t start = getushort(dirent->deStartCluster);
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t n, count;
+    uint16_t cluster, next;
+    int i;
+
+    if (!is_valid_cluster(start, bpb))
+	return 0;
+
+    for (i = 0; i < TAIL_CACHE_SIZE; i++) 
+    {
+	if (tail_cache[i].start == start && tail_cache[i].size == size)
+	    return tail_cache[i].tail;
+    }
+
+    /* not cached: walk the chain once, for as many clusters as the
+       size says there should be */
+    n = (size + clust_size - 1) / clust_size;
+    cluster = start;
+    for (count = 1; count < n; count++) 
+    {
+	next = get_fat_entry(cluster, image_buf, bpb);
+	if (!is_valid_cluster(next, bpb))
+	    break;
+	cluster = next;
+    }
+    tail_cache_store(start, cluster, size);
+    return cluster;
+}
+
+
+/* find a free cluster, looking first at hint and then working
+   forwards, so a file being extended stays contiguous when it can */
+static uint16_t find_free_near(uint16_t hint, uint8_t *image_buf,
+			       struct bpb33 *bpb)
+{
+    uint32_t end = data_clusters(bpb) + CLUST_FIRST;
+    uint32_t i;
+
+    if (hint < CLUST_FIRST)
+	hint = CLUST_FIRST;
+    for (i = hint; i < end; i++) 
+    {
+	if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE)
+	    return i;
+    }
+    for (i = CLUST_FIRST; i < hint && i < end; i++) 
+    {
+	if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE)
+	    return i;
+    }
+    return 0;
+}
+
+
+/* append_file adds len bytes of data to the end of a file.  It tops
+   up the file's last cluster, then extends the chain with clusters
+   taken as close after the tail as possible, so the cost depends on
+   how much is appended rather than on the size of the file.  Returns
+   0, or -1 if the disk filled up (whatever did fit is kept).  The
+   caller should hold the FAT lock and the lock on the directory. */
+int append_file(struct direntry *dirent, uint8_t *data, uint32_t len,
+		uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint32_t size = getulong(dirent->deFileSize);
+    uint32_t used = size % clust_size;
+    uint16_t tail = find_tail(dirent, image_buf, bpb);
+    uint32_t nbytes;
+    int rv = 0;
+
+    /* fill the partly used last cluster (an empty file may still
+       own a cluster) */
+    if (tail != 0 && (used != 0 || size == 0) && len > 0) 
+    {
+	nbytes = len < clust_size - used ? len : clust_size - used;
+	memcpy(cluster_to_addr(tail, image_buf, bpb) + used, data, nbytes);
+	data += nbytes;
+	len -= nbytes;
+	size += nbytes;
+    }
+
+    /* then add whole new clusters */
+    while (len > 0) 
+    {
+	uint16_t cluster = find_free_near(tail + 1, image_buf, bpb);
+	uint8_t *p;
+
+	if (cluster == 0) 
+	{
+	    rv = -1;
+	    break;
+	}
+	set_fat_entry(cluster, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
+	if (tail == 0)
+	    putushort(dirent->deStartCluster, cluster);
+	else
+	    set_fat_entry(tail, cluster, image_buf, bpb);
+	tail = cluster;
+
+	nbytes = len < clust_size ? len : clust_size;
+	p = cluster_to_addr(cluster, image_buf, bpb);
+	memcpy(p, data, nbytes);
+	memset(p + nbytes, 0, clust_size - nbytes);
+	data += nbytes;
+	len -= nbytes;
+	size += nbytes;
+    }
+
+    putulong(dirent->deFileSize, size);
+    if (tail != 0)
+	tail_cache_store(getushort(dirent->deStartCluster), tail, size);
+    return rv;
+}
+
+
+/* how many data clusters the volume really has.  The FAT usually has
+   room for a few more entries than that, and they mustn't be handed
+   out. */
+static uint32_t data_clusters(struct bpb33 *bpb)
+{
+    uint32_t root_secs = (bpb->bpbRootDirEnts * sizeof(struct direntry) 
+			  + bpb->bpbBytesPerSec - 1) / bpb->bpbBytesPerSec;
+    uint32_t data_secs = bpb->bpbSectors - bpb->bpbResSectors 
+	- bpb->bpbFATs * bpb->bpbFATsecs - root_secs;
+
+    return data_secs / bpb->bpbSecPerClust;
+}
+
+
+/* The tools that move chains about have to know which chains are
+   safe to move and which clusters are safe to move them onto, even on
+   an image that doesn't check clean.  cluster_refs_build counts the
+   FAT entries and directory entries that point at each cluster.  A
+   chain can be moved if each of its clusters is pointed at exactly
+   once; a cluster can be moved onto only if it's free in the FAT and
+   nothing points at it, which keeps us off the clusters of a broken
+   chain that the FAT has lost track of.  The caller should hold the
+   FAT lock. */
+
+static void cluster_ref(struct cluster_refs *refs, uint16_t cluster)
+{
+    if (cluster >= CLUST_FIRST && cluster < refs->end &&
+	refs->count[cluster] < 255)
+	refs->count[cluster]++;
+}
+
+
+void cluster_refs_build(struct cluster_refs *refs, int fd,
+			uint8_t *image_buf, struct bpb33 *bpb)
+{
+    /* every entry the FAT has room for, not just those with a data
+       cluster behind them: a chain that strays past the end can come
+       back */
+    uint32_t entries = bpb->bpbFATsecs * bpb->bpbBytesPerSec * 2 / 3;
+    struct dir_iter it;
+    struct dir_rec rec;
+    uint32_t i;
+
+    refs->end = data_clusters(bpb) + CLUST_FIRST;
+    refs->count = calloc(refs->end, 1);
+    for (i = CLUST_FIRST; i < entries && i <= FAT12_MASK; i++)
+	cluster_ref(refs, get_fat_entry(i, image_buf, bpb));
+
+    dir_iter_init(&it, 0, fd, image_buf, bpb);
+    while (dir_iter_next(&it, &rec)) 
+    {
+	if ((rec.dirent->deAttributes & ATTR_VOLUME) == 0)
+	    cluster_ref(refs, getushort(rec.dirent->deStartCluster));
+    }
+    dir_iter_finish(&it);
+}
+
+
+void cluster_refs_free(struct cluster_refs *refs)
+{
+    free(refs->count);
+    refs->count = NULL;
+}
+
+
+/* chain_movable says whether the chain starting at cluster can be
+   moved: every cluster of it in range and pointed at only once (so
+   it's neither shared nor a loop), and the chain properly ended */
+int chain_movable(uint16_t cluster, struct cluster_refs *refs,
+		  uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t steps = 0;
+
+    while (cluster >= CLUST_FIRST && cluster < refs->end &&
+	   refs->count[cluster] == 1 && steps++ < refs->end) 
+    {
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+	if (cluster >= (FAT12_MASK & CLUST_EOFS))
+	    return 1;
+    }
+    return 0;
+}
+
+
+/* find_free_extent returns the first cluster of the first run of n
+   free clusters at or after hint, or failing that the first one
+   before it, or 0 if there isn't one.  With refs, clusters that
+   anything still points at don't count as free. */
+uint16_t find_free_extent(uint32_t n, uint16_t hint, 
+			  struct cluster_refs *refs,
+			  uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t end = data_clusters(bpb) + CLUST_FIRST;
+    uint32_t i, start = 0, run = 0;
+
+    if (n == 0)
+	return 0;
+    if (hint < CLUST_FIRST || hint >= end)
+	hint = CLUST_FIRST;
+    for (i = hint; i < end; i++) 
+    {
+	if (get_fat_entry(i, image_buf, bpb) != CLUST_FREE ||
+	    (refs != NULL && refs->count[i] != 0)) 
+	{
+	    run = 0;
+	    continue;
+	}
+	if (run++ == 0)
+	    start = i;
+	if (run == n)
+	    return start;
+    }
+    if (hint == CLUST_FIRST)
+	return 0;
+    return find_free_extent(n, CLUST_FIRST, refs, image_buf, bpb);
+}
+
+
+/* write the pages of the image covering [start, start + len) back to
+   the file before going on */
+static void sync_range(uint8_t *start, size_t len)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t s = (uintptr_t)start & ~(page - 1);
+
+    msync((void *)s, (uintptr_t)start + len - s, MS_SYNC);
+}
+
+
+/* move_chain moves a file into one contiguous run of free clusters,
+   the first one at or after hint that's big enough.
+   The data is copied and the new chain written into the FAT, and both
+   are synced to the file; then the directory entry is switched over
+   to the new chain with one write of deStartCluster, and synced in
+   turn; only then is the old chain freed.  If we're stopped part way,
+   the file is whole in one place or the other - at worst the new
+   clusters are left orphaned for scandisk to find.  Returns the
+   number of clusters moved, 0 if there's no run big enough, or -1 if
+   the chain is shared, looped or broken and mustn't be touched.
+   refs is kept up to date with the move.  The caller should hold the
+   FAT lock and the lock on the directory entry. */
+
+int move_chain(struct direntry *dirent, uint16_t hint, 
+	       struct cluster_refs *refs,
+	       uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    uint16_t *list = NULL;
+    uint16_t start, dest;
+    int n = 0, cap = 0, i;
+
+    start = getushort(dirent->deStartCluster);
+    if (!chain_movable(start, refs, image_buf, bpb))
+	return -1;
+    collect_chain(start, &list, &n, &cap, image_buf, bpb);
+    dest = find_free_extent(n, hint, refs, image_buf, bpb);
+    if (dest == 0) 
+    {
+	free(list);
+	return 0;
+    }
+
+    for (i = 0; i < n; i++) 
+    {
+	memcpy(cluster_to_addr(dest + i, image_buf, bpb),
+	       cluster_to_addr(list[i], image_buf, bpb), clust_size);
+	set_fat_entry(dest + i, i == n - 1 ? (FAT12_MASK & CLUST_EOFS) 
+		      : dest + i + 1, image_buf, bpb);
+    }
+    sync_range(cluster_to_addr(dest, image_buf, bpb), n * clust_size);
+    sync_range(image_buf + bpb->bpbResSectors * bpb->bpbBytesPerSec,
+	       bpb->bpbFATsecs * bpb->bpbBytesPerSec);
+
+    putushort(dirent->deStartCluster, dest);
+    sync_range((uint8_t*)dirent, sizeof(struct direntry));
+
+    free_clusters(list, n, NULL, image_buf, bpb);
+    for (i = 0; i < n; i++) 
+    {
+	refs->count[list[i]] = 0;
+	refs->count[dest + i] = 1;
+    }
+    free(list);
+    return n;
+}
+
+
+/* The readahead planner walks a file's cluster chain ahead of the
+   reader and tells the kernel which parts of the mapping are about to
+   be touched.  The kernel's own readahead only sees linear faults,
+   which is no help when a fragmented chain jumps around the image. */
+
+static void ra_hint(uint8_t *start, uint8_t *end, int advice)
+{
+    uintptr_t pagesize = sysconf(_SC_PAGESIZE);
+    uintptr_t s = (uintptr_t)start;
+    uintptr_t e = (uintptr_t)end;
+
+    if (advice == MADV_WILLNEED)
+    {
+	/* cover every page the range touches */
+	s &= ~(pagesize - 1);
+	e = (e + pagesize - 1) & ~(pagesize - 1);
+    }
+    else
+    {
+	/* only give back pages that lie entirely inside the range */
+	s = (s + pagesize - 1) & ~(pagesize - 1);
+	e &= ~(pagesize - 1);
+    }
+    if (e > s)
+	madvise((void *)s, e - s, advice);
+}
+
+
+/* hint clusters from the cursor onwards until window clusters are
+   outstanding, merging physically adjacent clusters into one range */
+static void ra_refill(struct readahead *ra)
+{
+    uint32_t clust_size = ra->bpb->bpbBytesPerSec * ra->bpb->bpbSecPerClust;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uint8_t *start = NULL, *end = NULL;
+
+    while (ra->hinted < ra->window && is_valid_cluster(ra->cursor, ra->bpb))
+    {
+	uint8_t *p = cluster_to_addr(ra->cursor, ra->image_buf, ra->bpb);
+	uintptr_t a = (uintptr_t)p & ~(page - 1);
+	uintptr_t e = ((uintptr_t)end + page - 1) & ~(page - 1);
+
+	/* a cluster further on in a page the range already reaches,
+	   or the page after, costs nothing extra to take in */
+	if (start != NULL && p >= start && a <= e)
+	{
+	    if (p + clust_size > end)
+		end = p + clust_size;
+	}
+	else
+	{
+	    if (start != NULL)
+		ra_hint(start, end, MADV_WILLNEED);
+	    start = p;
+	    end = p + clust_size;
+	}
+	ra->hinted++;
+	ra->cursor = get_fat_entry(ra->cursor, ra->image_buf, ra->bpb);
+    }
+    if (start != NULL)
+	ra_hint(start, end, MADV_WILLNEED);
+}
+
+
+/* ra_init starts planning readahead for the chain beginning at
+   cluster, keeping up to window clusters hinted ahead of the reader.
+   A window of 0 turns the planner off. */
+void ra_init(struct readahead *ra, uint16_t cluster, int window,
+	     uint8_t *image_buf, struct bpb33 *bpb)
+{
+    memset(ra, 0, sizeof(struct readahead));
+    ra->image_buf = image_buf;
+    ra->bpb = bpb;
+    ra->window = window;
+    ra->cursor = cluster;
+
+    /* on huge images, don't let a long copy fill memory with pages
+       we'll never look at again */
+    ra->drop = (image_size(image_buf) > RA_DROP_THRESHOLD);
+    ra_refill(ra);
+}
+
+
+/* ra_consume tells the planner the reader is done with cluster */
+void ra_consume(struct readahead *ra, uint16_t cluster)
+{
+    if (ra->window <= 0)
+	return;
+
+    if (ra->hinted > 0)
+	ra->hinted--;
+
+    if (ra->drop)
+    {
+	uint32_t clust_size = ra->bpb->bpbBytesPerSec * ra->bpb->bpbSecPerClust;
+	uint8_t *p = cluster_to_addr(cluster, ra->image_buf, ra->bpb);
+	if (p != ra->drop_end)
+	{
+	    if (ra->drop_start != NULL)
+		ra_hint(ra->drop_start, ra->drop_end, MADV_DONTNEED);
+	    ra->drop_start = p;
+	}
+	ra->drop_end = p + clust_size;
+    }
+
+    /* top the window up in batches rather than a cluster at a time,
+       so each madvise covers a useful stretch of the chain */
+    if (ra->hinted < (ra->window + 1) / 2)
+	ra_refill(ra);
+}
+
+
+/* ra_finish releases whatever consumed range is still pending */
+void ra_finish(struct readahead *ra)
+{
+    if (ra->drop && ra->drop_start != NULL)
+	ra_hint(ra->drop_start, ra->drop_end, MADV_DONTNEED);
+    ra->drop_start = ra->drop_end = NULL;
+}
+
+/* state shared between the two halves of the copy-out pipeline */
+
+struct pipe_slot
+{
+    uint8_t *buf;
+    uint32_t len;
+};
+
+struct copy_pipe
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_full;
+    pthread_cond_t not_empty;
+    struct pipe_slot *slots;
+    int depth;
+    int head;		/* next slot the reader fills */
+    int tail;		/* next slot the writer drains */
+    int count;		/* number of filled slots */
+    int done;		/* reader has nothing more to produce */
+    int error;		/* reader hit a broken chain */
+    int cancel;		/* writer gave up (write error) */
+    int window;		/* readahead window, in clusters */
+    uint32_t slot_size;
+    uint16_t cluster;
+    uint32_t bytes_remaining;
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+};
+
+static void *copy_pipe_reader(void *arg)
+{
+    struct copy_pipe *cp = arg;
+    uint32_t clust_size = cp->bpb->bpbBytesPerSec * cp->bpb->bpbSecPerClust;
+    uint16_t cluster = cp->cluster;
+    uint32_t bytes_remaining = cp->bytes_remaining;
+    struct readahead ra;
+    int error = 0;
+
+    ra_init(&ra, cluster, cp->window, cp->image_buf, cp->bpb);
+
+    while (bytes_remaining > 0 && !error)
+    {
+	struct pipe_slot *slot;
+
+	/* wait for a free buffer in the ring */
+	pthread_mutex_lock(&cp->lock);
+	while (cp->count == cp->depth && !cp->cancel)
+	    pthread_cond_wait(&cp->not_full, &cp->lock);
+	if (cp->cancel)
+	{
+	    pthread_mutex_unlock(&cp->lock);
+	    break;
+	}
+	slot = &cp->slots[cp->head];
+	pthread_mutex_unlock(&cp->lock);
+
+	/* fill the buffer with as many clusters as fit */
+	slot->len = 0;
+	while (bytes_remaining > 0 && slot->len + clust_size <= cp->slot_size)
+	{
+	    uint32_t nbytes;
+
+	    if (!is_valid_cluster(cluster, cp->bpb))
+	    {
+		error = 1;
+		break;
+	    }
+	    nbytes = bytes_remaining > clust_size ? clust_size : bytes_remaining;
+	    memcpy(slot->buf + slot->len,
+		   cluster_to_addr(cluster, cp->image_buf, cp->bpb), nbytes);
+	    slot->len += nbytes;
+	    bytes_remaining -= nbytes;
+	    trace_cluster(cluster);
+	    ra_consume(&ra, cluster);
+	    cluster = get_fat_entry(cluster, cp->image_buf, cp->bpb);
+	}
+
+	pthread_mutex_lock(&cp->lock);
+	if (slot->len > 0)
+	{
+	    cp->head = (cp->head + 1) % cp->depth;
+	    cp->count++;
+	    pthread_cond_signal(&cp->not_empty);
+	}
+	pthread_mutex_unlock(&cp->lock);
+    }
+
+    ra_finish(&ra);
+
+    pthread_mutex_lock(&cp->lock);
+    cp->done = 1;
+    cp->error = error;
+    pthread_cond_signal(&cp->not_empty);
+    pthread_mutex_unlock(&cp->lock);
+    return NULL;
+}
+
+/* copy_chain_out copies bytes_remaining bytes of the cluster chain
+   starting at cluster to out.  A reader thread walks the chain and
+   gathers clusters into a ring of depth buffers while the calling
+   thread drains them, so a slow destination doesn't stall reads from
+   the image (and vice versa).  The reader keeps window clusters of
+   the chain hinted ahead of it.  Returns 0 on success, -1 if the chain
+   ended before all the bytes were copied or the write failed. */
+
+int copy_chain_out(FILE *out, uint16_t cluster, uint32_t bytes_remaining,
+		   int depth, int window, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct copy_pipe cp;
+    pthread_t reader;
+    uint32_t clust_size;
+    int i, rv;
+
+    clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    /* a single buffer still works, the two threads just take turns */
+    if (depth < 1)
+	depth = 1;
+
+    memset(&cp, 0, sizeof(cp));
+    pthread_mutex_init(&cp.lock, NULL);
+    pthread_cond_init(&cp.not_full, NULL);
+    pthread_cond_init(&cp.not_empty, NULL);
+    cp.depth = depth;
+    cp.window = window;
+    cp.cluster = cluster;
+    cp.bytes_remaining = bytes_remaining;
+    cp.image_buf = image_buf;
+    cp.bpb = bpb;
+
+    /* each slot holds a whole number of clusters */
+    cp.slot_size = PIPELINE_CHUNK - (PIPELINE_CHUNK % clust_size);
+    if (cp.slot_size < clust_size)
+	cp.slot_size = clust_size;
+    cp.slots = malloc(depth * sizeof(struct pipe_slot));
+    for (i = 0; i < depth; i++)
+	cp.slots[i].buf = malloc(cp.slot_size);
+
+    if (pthread_create(&reader, NULL, copy_pipe_reader, &cp) != 0)
+    {
+	fprintf(stderr, "Failed to start reader thread: %s\n", strerror(errno));
+	exit(1);
+    }
+
+    while (1)
+    {
+	struct pipe_slot *slot;
+
+	pthread_mutex_lock(&cp.lock);
+	while (cp.count == 0 && !cp.done)
+	    pthread_cond_wait(&cp.not_empty, &cp.lock);
+	if (cp.count == 0)
+	{
+	    /* the reader has finished and the ring is drained */
+	    pthread_mutex_unlock(&cp.lock);
+	    break;
+	}
+	slot = &cp.slots[cp.tail];
+	pthread_mutex_unlock(&cp.lock);
+
+	if (fwrite(slot->buf, 1, slot->len, out) != slot->len)
+	{
+	    fprintf(stderr, "Write failed: %s\n", strerror(errno));
+	    pthread_mutex_lock(&cp.lock);
+	    cp.cancel = 1;
+	    pthread_cond_signal(&cp.not_full);
+	    pthread_mutex_unlock(&cp.lock);
+	    break;
+	}
+
+	pthread_mutex_lock(&cp.lock);
+	cp.tail = (cp.tail + 1) % cp.depth;
+	cp.count--;
+	pthread_cond_signal(&cp.not_full);
+	pthread_mutex_unlock(&cp.lock);
+    }
+
+    pthread_join(reader, NULL);
+    rv = (cp.error || cp.cancel) ? -1 : 0;
+
+    for (i = 0; i < depth; i++)
+	free(cp.slots[i].buf);
+    free(cp.slots);
+    pthread_cond_destroy(&cp.not_empty);
+    pthread_cond_destroy(&cp.not_full);
+    pthread_mutex_destroy(&cp.lock);
+    return rv;
+}
+
+
+/* fat_usage counts the used, free and bad clusters on the volume and
+   builds a histogram of the lengths of the free extents, in one pass
+   over the first FAT.
+
+   Rather than decoding one 12-bit entry at a time, it reads 6 bytes
+   (4 entries) into a 64-bit word and tests all 4 at once: adding 0x7ff
+   to the low 11 bits of a field carries into its top bit if any of
+   them are set, so ((x & L) + L) | x has the top bit of each field set
+   exactly when that field is non-zero, and no carry crosses into the
+   next field.  XORing with the bad cluster value first finds the bad
+   clusters the same way.  A word of all-free or all-used entries is
+   dealt with as a whole; only mixed ones are looked at entry by
+   entry to find where the free extents start and end. */
+
+#define FAT12_LOW  0x7ff7ff7ff7ffULL	/* low 11 bits of each entry */
+#define FAT12_HIGH 0x800800800800ULL	/* top bit of each entry */
+#define FAT12_BADS 0xff7ff7ff7ff7ULL	/* 4 bad cluster markers */
+
+static void fat_usage_extent(struct fat_usage *fu, uint32_t start, 
+			     uint32_t len)
+{
+    int bucket = 0;
+
+    if (len == 0)
+	return;
+    while (bucket < FAT_USAGE_BUCKETS - 1 && (len >> (bucket + 1)) != 0)
+	bucket++;
+    fu->extents[bucket]++;
+    fu->nextents++;
+    if (len > fu->largest_free) 
+    {
+	fu->largest_free = len;
+	fu->largest_free_start = start;
+    }
+}
+
+
+void fat_usage(struct fat_usage *fu, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint8_t *fat = image_buf + bpb->bpbResSectors * bpb->bpbBytesPerSec;
+    uint32_t nentries, i, run_start = 0, run = 0;
+    uint64_t x, y, valid, nz, freebits, badbits;
+    uint8_t *p;
+    int k;
+
+    memset(fu, 0, sizeof(struct fat_usage));
+    fu->clusters = data_clusters(bpb);
+    nentries = fu->clusters + CLUST_FIRST;
+
+    /* don't go past what the FAT can hold */
+    if (nentries > bpb->bpbFATsecs * bpb->bpbBytesPerSec * 2 / 3)
+	nentries = bpb->bpbFATsecs * bpb->bpbBytesPerSec * 2 / 3;
+
+    for (i = 0; i < nentries; i += 4) 
+    {
+	p = fat + i / 2 * 3;
+	x = (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16;
+	if (i + 2 < nentries)
+	    x |= (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 
+		| (uint64_t)p[5] << 40;
+
+	/* only count the entries that describe data clusters */
+	valid = FAT12_HIGH;
+	if (i < CLUST_FIRST)
+	    valid &= ~0x800800ULL;
+	if (nentries - i < 4)
+	    valid &= (1ULL << (12 * (nentries - i))) - 1;
+
+	nz = (((x & FAT12_LOW) + FAT12_LOW) | x) & FAT12_HIGH;
+	freebits = ~nz & valid;
+	y = x ^ FAT12_BADS;
+	badbits = ~((((y & FAT12_LOW) + FAT12_LOW) | y) & FAT12_HIGH) & valid;
+
+	fu->free += __builtin_popcountll(freebits);
+	fu->bad += __builtin_popcountll(badbits);
+
+	if (freebits == FAT12_HIGH) 
+	{
+	    /* all four free */
+	    if (run == 0)
+		run_start = i;
+	    run += 4;
+	    continue;
+	}
+	if (freebits == 0 && run == 0)
+	    continue;
+	for (k = 0; k < 4; k++) 
+	{
+	    if ((valid >> (12 * k + 11)) & 1) 
+	    {
+		if ((freebits >> (12 * k + 11)) & 1) 
+		{
+		    if (run == 0)
+			run_start = i + k;
+		    run++;
+		    continue;
+		}
+	    }
+	    fat_usage_extent(fu, run_start, run);
+	    run = 0;
+	}
+    }
+    fat_usage_extent(fu, run_start, run);
+    fu->used = fu->clusters - fu->free - fu->bad;
+}
+
+
+/* The access tracer.  If DOS_TRACE names a file, every file read
+   through the tools is logged to it.  The shared read paths (dos_cat's
+   do_cat, dos_cp's extract_file, and copy_chain_out under both) log a
+   line when they start on a file, then one per cluster as it is read:
+
+       read <start cluster> <clusters> <path>
+       cluster <cluster>
+
+   in the order the reads happen.  Each line goes out in one write to
+   a file opened for appending, so several tools can share one trace.
+   dos_layout reads the trace back to put files that are read together
+   next to each other. */
+
+static int trace_fd = -2;	/* -2 until we've looked at DOS_TRACE */
+
+void trace_read(char *path, struct direntry *dirent,
+		uint8_t *image_buf, struct bpb33 *bpb)
+{
+    char line[MAXPATHLEN + 64];
+    uint16_t start = getushort(dirent->deStartCluster);
+    uint32_t clusters;
+    char *name;
+    int len;
+
+    /* the first read of a file comes here before any of its clusters
+       are read, on the thread that opens it, so this is the only
+       place that needs to look */
+    if (trace_fd == -2) 
+    {
+	name = getenv("DOS_TRACE");
+	trace_fd = -1;
+	if (name != NULL && name[0] != '\0') 
+	{
+	    trace_fd = open(name, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	    if (trace_fd < 0)
+		fprintf(stderr, "Can't open trace file %s: %s\n", name,
+			strerror(errno));
+	}
+    }
+    if (trace_fd < 0)
+	return;
+
+    count_fragments(start, &clusters, image_buf, bpb);
+    while (*path == '/' || *path == '\\')
+	path++;
+    len = snprintf(line, sizeof(line), "read %u %u %s\n", start, clusters,
+		   path);
+    if (len > 0 && len < sizeof(line))
+	write(trace_fd, line, len);
+}
+
+
+/* trace_cluster logs one cluster of the file being read */
+void trace_cluster(uint16_t cluster)
+{
+    char line[32];
+    int len;
+
+    if (trace_fd < 0)
+	return;
+    len = snprintf(line, sizeof(line), "cluster %u\n", cluster);
+    write(trace_fd, line, len);
+}
@@ -4,6 +4,23 @@
 #define MAXPATHLEN 255
 #define MAXFILENAME 13
 
+/* flags for find_file, depending on whether we're searching for a
+   file or a directory */
+#define FIND_FILE 0
+#define FIND_DIR 1
+
+/* copy-out pipeline: number of ring buffers, and bytes per buffer */
+#define DEFAULT_PIPELINE_DEPTH 4
+#define PIPELINE_CHUNK (64 * 1024)
+
+/* threads used when copying several files in at once */
+#define DEFAULT_INGEST_THREADS 4
+
+/* readahead planner: clusters hinted ahead of the reader, and the
+   image size above which consumed ranges are given back */
+#define DEFAULT_READAHEAD 64
+#define RA_DROP_THRESHOLD (256 * 1024 * 1024)
+
 #ifndef TRUE
 #define TRUE (1)
 #define FALSE (0)
@@ -12,8 +29,101 @@
 /* prototypes for functions in dos.c */
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct cluster_alloc
+{
+    uint64_t *free_map;		/* one bit per cluster, set if free */
+    uint32_t total_clusters;
+    int ngroups;		/* number of allocation groups */
+    uint32_t *cursor;		/* per group: next cluster to try */
+};
+
+struct readahead
+{
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    int window;			/* clusters to keep hinted ahead */
+    int hinted;			/* clusters hinted but not yet consumed */
+    uint16_t cursor;		/* next cluster of the chain to hint */
+    int drop;			/* give back consumed ranges */
+    uint8_t *drop_start;	/* consumed range not yet given back */
+    uint8_t *drop_end;
+};
+
+/* one directory being read by a dir_iter */
+struct dir_frame
+{
+    uint16_t cluster;		/* cluster being read, 0 for the root */
+    int index;			/* next slot in it */
+    int pathlen;		/* length of the path to this directory */
+    uint16_t start;		/* first cluster */
+    int link;			/* parallel walk: position in the chain */
+};
+
+struct dir_task;
+
+struct dir_iter
+{
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+    int fd;			/* lock clusters on this, if >= 0 */
+    int flags;
+    struct dir_frame *stack;
+    int depth;			/* frames in use */
+    int cap;
+    uint16_t pending;		/* directory to go into next, or 0 */
+    uint8_t *visited;		/* clusters of the directories we're in */
+    struct dir_task **tasks;	/* parallel walk: directories read, by
+				   first cluster */
+    char *path;			/* grown as the walk goes deeper */
+    int pathcap;
+};
+
+/* what a dir_iter hands back */
+struct dir_rec
+{
+    char *path;			/* full path from the root */
+    struct direntry *dirent;	/* NULL at the start of a cluster */
+    int depth;			/* 0 in the root directory */
+    uint16_t cluster;		/* directory cluster the entry is in */
+    int loop;			/* directory we've already been in */
+};
+
+/* dir_iter flags */
+#define DIR_ITER_CLUSTERS 1	/* also report the start of each
+				   subdirectory cluster */
+
+/* what fat_usage finds.  Bucket i of extents counts the free extents
+   of 2^i to 2^(i+1) - 1 clusters. */
+#define FAT_USAGE_BUCKETS 16
+
+struct fat_usage
+{
+    uint32_t clusters;		/* data clusters on the volume */
+    uint32_t used;
+    uint32_t free;
+    uint32_t bad;
+    uint32_t nextents;		/* free extents */
+    uint32_t largest_free;	/* clusters in the largest of them */
+    uint32_t largest_free_start;
+    uint32_t extents[FAT_USAGE_BUCKETS];
+};
 
+/* for the tools that move chains about: how many FAT entries and
+   directory entries point at each cluster */
+struct cluster_refs
+{
+    uint8_t *count;		/* saturates at 255 */
+    uint32_t end;		/* one past the last data cluster */
+};
+
+#define MAP_IMAGE_PRIVATE 1	/* read-only file, copy-on-write mapping */
+
+uint8_t *map_image(char *, int *, int);
 uint8_t *mmap_file(char *, int *);
+size_t image_size(uint8_t *);
 void unmmap_file(uint8_t *, int *);
 
 struct bpb33* check_bootsector(uint8_t *);
@@ -21,6 +131,7 @@ struct bpb33* check_bootsector(uint8_t *);
 uint16_t get_fat_entry(uint16_t, uint8_t *, struct bpb33 *);
 
 void set_fat_entry(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
+void set_fat_entry_atomic(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
 
 int is_end_of_file(uint16_t);
 int is_valid_cluster(uint16_t, struct bpb33 *);
@@ -29,4 +140,69 @@ uint8_t *root_dir_addr(uint8_t *, struct bpb33 *);
 
 uint8_t *cluster_to_addr(uint16_t, uint8_t *, struct bpb33 *);
 
+void get_name(char *, struct direntry *);
+struct direntry* find_file(char *, uint16_t, int, int,
+			   uint8_t *, struct bpb33 *);
+int find_files(char **, int, struct direntry **, int,
+	       uint8_t *, struct bpb33 *);
+void dir_iter_init(struct dir_iter *, int, int, uint8_t *, struct bpb33 *);
+void dir_iter_init_parallel(struct dir_iter *, int, int, int,
+			    uint8_t *, struct bpb33 *);
+int dir_iter_next(struct dir_iter *, struct dir_rec *);
+void dir_iter_finish(struct dir_iter *);
+void write_dirent(struct direntry *, char *, uint16_t, uint32_t);
+void write_dir_dirent(struct direntry *, char *, uint16_t);
+uint16_t addr_to_cluster(uint8_t *, uint8_t *, struct bpb33 *);
+int reserve_dirents(struct direntry *, int, uint8_t *, struct bpb33 *);
+struct direntry *create_dirent(struct direntry *, char *, uint16_t, uint32_t,
+			       uint8_t *, struct bpb33 *);
+void delete_dirent(struct direntry *);
+int make_dir(char *, int, int, uint8_t *, struct bpb33 *);
+
+int lock_range(int, off_t, off_t, short);
+int lock_fat(int, struct bpb33 *, short);
+int lock_dir(int, uint8_t *, uint8_t *, struct bpb33 *, short);
+int lock_image(int, short);
+int lock_dir_chain(int, uint16_t, uint8_t *, struct bpb33 *, short);
+
+void alloc_init(struct cluster_alloc *, int, uint8_t *, struct bpb33 *);
+void alloc_destroy(struct cluster_alloc *);
+uint32_t alloc_group_start(struct cluster_alloc *, int);
+uint16_t alloc_cluster(struct cluster_alloc *, int);
+void alloc_release(struct cluster_alloc *, uint16_t);
+
+int collect_chain(uint16_t, uint16_t **, int *, int *,
+		  uint8_t *, struct bpb33 *);
+int count_fragments(uint16_t, uint32_t *, uint8_t *, struct bpb33 *);
+void free_clusters(uint16_t *, int, struct cluster_alloc *,
+		   uint8_t *, struct bpb33 *);
+int resize_chain(struct direntry *, uint32_t, struct cluster_alloc *,
+		 uint8_t *, struct bpb33 *);
+int truncate_file(struct direntry *, uint32_t, struct cluster_alloc *,
+		  uint8_t *, struct bpb33 *);
+
+uint16_t find_tail(struct direntry *, uint8_t *, struct bpb33 *);
+int append_file(struct direntry *, uint8_t *, uint32_t,
+		uint8_t *, struct bpb33 *);
+
+void cluster_refs_build(struct cluster_refs *, int, uint8_t *, struct bpb33 *);
+void cluster_refs_free(struct cluster_refs *);
+int chain_movable(uint16_t, struct cluster_refs *, uint8_t *, struct bpb33 *);
+uint16_t find_free_extent(uint32_t, uint16_t, struct cluster_refs *,
+			  uint8_t *, struct bpb33 *);
+int move_chain(struct direntry *, uint16_t, struct cluster_refs *,
+	       uint8_t *, struct bpb33 *);
+
+void ra_init(struct readahead *, uint16_t, int, uint8_t *, struct bpb33 *);
+void ra_consume(struct readahead *, uint16_t);
+void ra_finish(struct readahead *);
+
+int copy_chain_out(FILE *, uint16_t, uint32_t, int, int,
+		   uint8_t *, struct bpb33 *);
+
+void fat_usage(struct fat_usage *, uint8_t *, struct bpb33 *);
+
+void trace_read(char *, struct direntry *, uint8_t *, struct bpb33 *);
+void trace_cluster(uint16_t);
+
 #endif // __DOS_H__
@@ -99,108 +99,10 @@ uint16_t get_dirent(struct direntry *dirent, char *buffer)
 }
 
 
-struct direntry *follow_dir(char *searchpath, uint16_t cluster, 
-		            uint8_t *image_buf, struct bpb33* bpb)
-{
-    char *next_path_component = index(searchpath, '/');
-    int entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
-    {
-        entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
-    }
-
-    struct direntry *rv = NULL;
-
-    while (is_valid_cluster(cluster, bpb))
-    {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
-	{
-            char buffer[MAXFILENAME]; 
-            uint16_t followclust = get_dirent(dirent, buffer);
-
-            if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
-            {
-                if (next_path_component)
-                {
-                    if (followclust)
-                        rv = follow_dir(buffer, followclust, image_buf, bpb);
-                }
-                else
-                {
-                    rv = dirent; 
-                }
-            }
-
-            if (rv)
-                break;
-
-            dirent++;
-	}
-
-	cluster = get_fat_entry(cluster, image_buf, bpb);
-    }
-
-    return rv;
-}
-
-
-struct direntry *traverse_root(char *searchpath, uint8_t *image_buf, struct bpb33* bpb)
-{
-    uint16_t cluster = 0;
-    struct direntry *rv = NULL;
-
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-    char *next_path_component = index(searchpath, '/');
-    int root_entry_len = strlen(searchpath);
-    if (next_path_component != NULL)
-    {
-        root_entry_len = next_path_component - searchpath;
-        *next_path_component = '\0';
-        next_path_component++;
-    }
-
-    char buffer[MAXFILENAME];
-
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
-    {
-        uint16_t followclust = get_dirent(dirent, buffer);
-
-        if (strncasecmp(searchpath, buffer, strlen(searchpath)) == 0)
-        {
-            if (!next_path_component)
-                rv = dirent;
-            else if (is_valid_cluster(followclust, bpb))
-                rv = follow_dir(next_path_component, followclust, image_buf, bpb);
-        }
-
-        if (rv)
-            break;
-
-        dirent++;
-    }
-
-    return rv;
-}
-
-
-struct direntry *find_file(char *searchpath, uint8_t *image_buf, struct bpb33 *bpb)
-{
-    /* strip any leading '/' from search path */
-    while (*searchpath == '/' && *searchpath != '\0') searchpath++;
-    return traverse_root(searchpath, image_buf, bpb);
-}
-
-
-void do_cat(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
+void do_cat(char *path, struct direntry *dirent, int depth, int window,
+	    uint8_t *image_buf, struct bpb33 *bpb)
 {
+    struct readahead ra;
     uint16_t cluster = getushort(dirent->deStartCluster);
     uint32_t bytes_remaining = getulong(dirent->deFileSize);
     uint16_t cluster_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
@@ -209,6 +111,17 @@ void do_cat(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
     get_dirent(dirent, buffer);
 
     fprintf(stderr, "doing cat for %s, size %d\n", buffer, bytes_remaining);
+    trace_read(path, dirent, image_buf, bpb);
+
+    if (depth > 0)
+    {
+        /* overlap reading the image with writing stdout */
+        copy_chain_out(stdout, cluster, bytes_remaining, depth, window,
+                       image_buf, bpb);
+        return;
+    }
+
+    ra_init(&ra, cluster, window, image_buf, bpb);
 
     while (is_valid_cluster(cluster, bpb))
     {
@@ -219,15 +132,18 @@ void do_cat(struct direntry *dirent, uint8_t *image_buf, struct bpb33 *bpb)
 
         fwrite(p, 1, nbytes, stdout);
         bytes_remaining -= nbytes;
+        trace_cluster(cluster);
+        ra_consume(&ra, cluster);
     
         cluster = get_fat_entry(cluster, image_buf, bpb);
     }
+    ra_finish(&ra);
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename> <filename>\n", progname);
+    fprintf(stderr, "usage: %s [-d depth] [-r clusters] <imagename> <filename>\n", progname);
     exit(1);
 }
 
@@ -235,19 +151,47 @@ void usage(char *progname)
 int main(int argc, char** argv)
 {
     uint8_t *image_buf;
-    int fd;
+    int fd, opt;
+    int depth = DEFAULT_PIPELINE_DEPTH;
+    int window = DEFAULT_READAHEAD;
     struct bpb33* bpb;
-    if (argc != 3)
+
+    while ((opt = getopt(argc, argv, "d:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'r':
+            window = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    image_buf = mmap_file(argv[optind], &fd);
     bpb = check_bootsector(image_buf);
 
-    struct direntry *dirent = find_file(argv[2], image_buf, bpb);
+    /* hold the FAT still while we follow chains */
+    lock_fat(fd, bpb, F_RDLCK);
+    struct direntry *dirent = find_file(argv[optind + 1], 0, FIND_FILE, fd,
+                                        image_buf, bpb);
     if (dirent)
-        do_cat(dirent, image_buf, bpb);
+    {
+        do_cat(argv[optind + 1], dirent, depth, window, image_buf, bpb);
+    }
+    else if (errno == EISDIR)
+    {
+        fprintf(stderr, "%s is a directory\n", argv[optind + 1]);
+        exit(1);
+    }
+    lock_fat(fd, bpb, F_UNLCK);
 
     unmmap_file(image_buf, &fd);
 
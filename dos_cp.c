@@ -9,6 +9,8 @@
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -17,185 +19,12 @@
 #include "dos.h"
 
 
-/* get_name retrieves the filename from a directory entry */
-
-void get_name(char *fullname, struct direntry *dirent) 
-{
-    char name[9];
-    char extension[4];
-    int i;
-
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
-
-    /* names are space padded - remove the padding */
-    for (i = 8; i > 0; i--) 
-    {
-	if (name[i] == ' ') 
-	    name[i] = '\0';
-	else 
-	    break;
-    }
-
-    /* extensions aren't normally space padded - but remove the
-       padding anyway if it's there */
-    for (i = 3; i > 0; i--) 
-    {
-	if (extension[i] == ' ') 
-	    extension[i] = '\0';
-	else 
-	    break;
-    }
-    fullname[0]='\0';
-    strcat(fullname, name);
-
-    /* append the extension if it's not a directory */
-    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) 
-    {
-	strcat(fullname, ".");
-	strcat(fullname, extension);
-    }
-}
-
-
-/* find_file seeks through the directories in the memory disk image,
-   until it finds the named file */
-
-/* flags, depending on whether we're searching for a file or a
-   directory */
-#define FIND_FILE 0
-#define FIND_DIR 1
-
-struct direntry* find_file(char *infilename, uint16_t cluster,
-			   int find_mode,
-			   uint8_t *image_buf, struct bpb33* bpb)
-{
-    char buf[MAXPATHLEN];
-    char *seek_name, *next_name;
-    int d;
-    struct direntry *dirent;
-    uint16_t dir_cluster;
-    char fullname[13];
-
-    /* find the first dirent in this directory */
-    dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-    /* first we need to split the file name we're looking for into the
-       first part of the path, and the remainder.  We hunt through the
-       current directory for the first part.  If there's a remainder,
-       and what we find is a directory, then we recurse, and search
-       that directory for the remainder */
-
-    strncpy(buf, infilename, MAXPATHLEN);
-    seek_name = buf;
-
-    /* trim leading slashes */
-    while (*seek_name == '/' || *seek_name == '\\') 
-    {
-	seek_name++;
-    }
-
-    /* search for any more slashes - if so, it's a dirname */
-    next_name = seek_name;
-    while (1) 
-    {
-	if (*next_name == '/' || *next_name == '\\') 
-	{
-	    *next_name = '\0';
-	    next_name ++;
-	    break;
-	}
-	if (*next_name == '\0') 
-	{
-	    /* end of name - no slashes found */
-	    next_name = NULL;
-	    if (find_mode == FIND_DIR) 
-	    {
-		return dirent;
-	    }
-	    break;
-	}
-	next_name++;
-    }
-
-    while (1) 
-    {
-	/* hunt a cluster for the relevant dirent.  If we reach the
-	   end of the cluster, we'll need to go to the next cluster
-	   for this directory */
-	for (d = 0; 
-	     d < bpb->bpbBytesPerSec * bpb->bpbSecPerClust; 
-	     d += sizeof(struct direntry)) 
-	{
-	    if (dirent->deName[0] == SLOT_EMPTY) 
-	    {
-		/* we failed to find the file */
-		return NULL;
-	    }
-
-	    if (dirent->deName[0] == SLOT_DELETED) 
-	    {
-		/* skip over a deleted file */
-		dirent++;
-		continue;
-	    }
-
-	    get_name(fullname, dirent);
-	    if (strcmp(fullname, seek_name)==0) 
-	    {
-		/* found it! */
-		if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
-		{
-		    /* it's a directory */
-		    if (next_name == NULL) 
-		    {
-			fprintf(stderr, "Cannot copy out a directory\n");
-			exit(1);
-		    }
-		    dir_cluster = getushort(dirent->deStartCluster);
-		    return find_file(next_name, dir_cluster, 
-				     find_mode, image_buf, bpb);
-		} 
-		else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
-		{
-		    /* it's a volume */
-		    fprintf(stderr, "Cannot copy out a volume\n");
-		    exit(1);
-		} 
-		else 
-		{
-		    /* assume it's a file */
-		    return dirent;
-		}
-	    }
-	    dirent++;
-	}
-
-	/* we've reached the end of the cluster for this directory.
-	   Where's the next cluster? */
-	if (cluster == 0) 
-	{
-	    // root dir is special
-	    dirent++;
-	} 
-	else 
-	{
-	    cluster = get_fat_entry(cluster, image_buf, bpb);
-	    dirent = (struct direntry*)cluster_to_addr(cluster, 
-						       image_buf, bpb);
-	}
-    }
-}
-
-
 /* copy_out_file actually does the work of copying, recursing through
    the clusters of the memory disk image, and copying out a cluster at
-   a time */
+   a time.  ra keeps the upcoming part of the chain prefetched */
 
 void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
-		   uint8_t *image_buf, struct bpb33* bpb)
+		   struct readahead *ra, uint8_t *image_buf, struct bpb33* bpb)
 {
     int total_clusters, clust_size;
     uint8_t *p;
@@ -223,75 +52,192 @@ void copy_out_file(FILE *fd, uint16_t cluster, uint32_t bytes_remaining,
     {
 	/* this is the last cluster */
 	fwrite(p, bytes_remaining, 1, fd);
+	trace_cluster(cluster);
+	ra_consume(ra, cluster);
     } 
     else 
     {
 	/* more clusters after this one */
 	fwrite(p, clust_size, 1, fd);
+	trace_cluster(cluster);
+	ra_consume(ra, cluster);
 
 	/* recurse, continuing to copy */
 	copy_out_file(fd, get_fat_entry(cluster, image_buf, bpb), 
-		      bytes_remaining - clust_size, image_buf, bpb);
+		      bytes_remaining - clust_size, ra, image_buf, bpb);
     }
     return;
 }
 
-/* copyout copies a file from the FAT-12 memory disk image to a
-   regular file in the file system */
+/* extract_file copies the file dirent, found at path in the image,
+   out to a regular file called outfilename.  The caller should hold
+   the FAT lock.  Returns 0, or -1 if the file can't be opened. */
 
-void copyout(char *infilename, char* outfilename,
-	     uint8_t *image_buf, struct bpb33* bpb)
+int extract_file(char *path, struct direntry *dirent, char *outfilename, 
+		 int depth, int window, uint8_t *image_buf, struct bpb33* bpb)
 {
-    struct direntry *dirent = (void*)1;
+    struct readahead ra;
     FILE *fd;
     uint16_t start_cluster;
     uint32_t size;
 
+    /* open the real file for writing */
+    fd = fopen(outfilename, "w");
+    if (fd == NULL) 
+    {
+	fprintf(stderr, "Can't open file %s to copy data out\n",
+		outfilename);
+	return -1;
+    }
+
+    trace_read(path, dirent, image_buf, bpb);
+    start_cluster = getushort(dirent->deStartCluster);
+    size = getulong(dirent->deFileSize);
+    if (depth > 0) 
+    {
+	/* overlap reading the image with writing the output */
+	if (copy_chain_out(fd, start_cluster, size, depth, window,
+			   image_buf, bpb) < 0)
+	{
+	    fprintf(stderr, "Bad file termination\n");
+	}
+    }
+    else 
+    {
+	ra_init(&ra, start_cluster, window, image_buf, bpb);
+	copy_out_file(fd, start_cluster, size, &ra, image_buf, bpb);
+	ra_finish(&ra);
+    }
+    
+    fclose(fd);
+    return 0;
+}
+
+/* copyout copies a file from the FAT-12 memory disk image to a
+   regular file in the file system */
+
+void copyout(char *infilename, char* outfilename, int depth, int window,
+	     int image_fd, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent = (void*)1;
+
     /* skip the volume name */
     assert(strncmp("a:", infilename, 2)==0);
     infilename+=2;
 
-    /* find the dirent of the file in the memory disk image */
-    dirent = find_file(infilename, 0, FIND_FILE, image_buf, bpb);
+    /* find the file and copy it out, making sure nobody changes the
+       FAT chain or removes the file under us in between */
+    lock_fat(image_fd, bpb, F_RDLCK);
+    dirent = find_file(infilename, 0, FIND_FILE, image_fd, image_buf, bpb);
+    if (dirent == NULL && errno == EISDIR) 
+    {
+	fprintf(stderr, "Cannot copy out a directory\n");
+	exit(1);
+    }
     if (dirent == NULL) 
     {
 	fprintf(stderr, "No file called %s exists in the disk image\n",
 		infilename);
 	exit(1);
     }
+    if (extract_file(infilename, dirent, outfilename, depth, window, 
+		     image_buf, bpb) < 0)
+	exit(1);
+    lock_fat(image_fd, bpb, F_UNLCK);
+}
 
-    /* open the real file for writing */
-    fd = fopen(outfilename, "w");
+/* copyout_manifest copies out every file listed in manifest, one
+   "a:<filename> <outfilename>" pair per line.  All the files are
+   looked up together, so each directory of the image is read once no
+   matter how many of the files are in it.  Returns 0, or 1 if any
+   file couldn't be copied. */
+
+int copyout_manifest(char *manifest, int depth, int window,
+		     int image_fd, uint8_t *image_buf, struct bpb33* bpb)
+{
+    FILE *fd;
+    char *line = NULL;
+    size_t linecap = 0;
+    char **srcs = NULL, **dsts = NULL;
+    struct direntry **dirents;
+    int n = 0, cap = 0, i;
+    int status = 0;
+
+    fd = fopen(manifest, "r");
     if (fd == NULL) 
     {
-	fprintf(stderr, "Can't open file %s to copy data out\n",
-		outfilename);
+	fprintf(stderr, "Can't open manifest %s\n", manifest);
 	exit(1);
     }
-
-    /* do the actual copy out*/
-    start_cluster = getushort(dirent->deStartCluster);
-    size = getulong(dirent->deFileSize);
-    copy_out_file(fd, start_cluster, size, image_buf, bpb);
-    
+    while (getline(&line, &linecap, fd) > 0) 
+    {
+	char *src = strtok(line, " \t\r\n");
+	char *dst = strtok(NULL, " \t\r\n");
+	if (src == NULL || src[0] == '#')
+	    continue;
+	if (dst == NULL || strncmp("a:", src, 2) != 0) 
+	{
+	    fprintf(stderr, "Bad manifest line for %s\n", src);
+	    status = 1;
+	    continue;
+	}
+	if (n == cap) 
+	{
+	    cap = cap ? cap * 2 : 64;
+	    srcs = realloc(srcs, cap * sizeof(char *));
+	    dsts = realloc(dsts, cap * sizeof(char *));
+	}
+	srcs[n] = strdup(src + 2);
+	dsts[n] = strdup(dst);
+	n++;
+    }
+    free(line);
     fclose(fd);
+
+    dirents = malloc((n ? n : 1) * sizeof(struct direntry *));
+    lock_fat(image_fd, bpb, F_RDLCK);
+    find_files(srcs, n, dirents, image_fd, image_buf, bpb);
+    for (i = 0; i < n; i++) 
+    {
+	if (dirents[i] == NULL) 
+	{
+	    fprintf(stderr, "No file called %s exists in the disk image\n",
+		    srcs[i]);
+	    status = 1;
+	}
+	else 
+	{
+	    if (extract_file(srcs[i], dirents[i], dsts[i], depth, window, 
+			     image_buf, bpb) < 0)
+		status = 1;
+	}
+	free(srcs[i]);
+	free(dsts[i]);
+    }
+    lock_fat(image_fd, bpb, F_UNLCK);
+
+    free(dirents);
+    free(srcs);
+    free(dsts);
+    return status;
 }
 
 /* copy_in_file actually does the copying of the file into the memory
    image, updates the FAT, and returns the starting cluster of the
-   file */
+   file.  Clusters come from allocation group of alloc, so several
+   threads can copy files in at once. */
 
-uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb, 
+uint16_t copy_in_file(FILE* fd, struct cluster_alloc *alloc, int group,
+		      uint8_t *image_buf, struct bpb33* bpb, 
 		      uint32_t *size)
 {
-    uint32_t clust_size, total_clusters, i;
+    uint32_t clust_size, i;
     uint8_t *buf;
     size_t bytes;
     uint16_t start_cluster = 0;
     uint16_t prev_cluster = 0;
     
     clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
-    total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
     buf = malloc(clust_size);
     while(1) 
     {
@@ -301,15 +247,8 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
 	    *size += bytes;
 
 	    /* find a free cluster */
-	    for (i = 2; i < total_clusters; i++) 
-	    {
-		if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) 
-		{
-		    break;
-		}
-	    }
-
-	    if (i == total_clusters) 
+	    i = alloc_cluster(alloc, group);
+	    if (i == 0) 
 	    {
 		/* oops - we ran out of disk space */
 		fprintf(stderr, "No more space in filesystem\n");
@@ -327,11 +266,11 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
 	    {
 		/* link the previous cluster to this one in the FAT */
 		assert(prev_cluster != 0);
-		set_fat_entry(prev_cluster, i, image_buf, bpb);
+		set_fat_entry_atomic(prev_cluster, i, image_buf, bpb);
 	    }
 
 	    /* make sure we've recorded this cluster as used */
-	    set_fat_entry(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
+	    set_fat_entry_atomic(i, FAT12_MASK&CLUST_EOFS, image_buf, bpb);
 
 	    /* copy the data into the cluster */
 	    memcpy(cluster_to_addr(i, image_buf, bpb), buf, clust_size);
@@ -350,124 +289,108 @@ uint16_t copy_in_file(FILE* fd, uint8_t *image_buf, struct bpb33* bpb,
     return start_cluster;
 }
 
-/* write the values into a directory entry */
-void write_dirent(struct direntry *dirent, char *filename, 
-		  uint16_t start_cluster, uint32_t size)
-{
-    char *p, *p2;
-    char *uppername;
-    int len, i;
-
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
+/* overwrite_file replaces the contents of an existing file in the
+   memory image.  The old cluster chain is trimmed or extended to fit
+   the new data, so a file of the same size is rewritten in place
+   without allocating anything.  The caller holds the FAT lock. */
 
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < strlen(filename); i++) 
-    {
-	if (p2[i] == '/' || p2[i] == '\\') 
-	{
-	    uppername = p2+i+1;
-	}
-    }
+void overwrite_file(FILE *fd, struct direntry *dirent, int image_fd,
+		    uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct stat st;
+    uint32_t clust_size, size, total = 0;
+    uint16_t cluster;
+    size_t bytes;
 
-    /* convert filename to upper case */
-    for (i = 0; i < strlen(uppername); i++) 
+    clust_size = bpb->bpbSecPerClust * bpb->bpbBytesPerSec;
+    if (fstat(fileno(fd), &st) < 0 || st.st_size > UINT32_MAX) 
     {
-	uppername[i] = toupper(uppername[i]);
+	fprintf(stderr, "Can't work out the size of the file to copy in\n");
+	exit(1);
     }
+    size = st.st_size;
 
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL) 
-    {
-	fprintf(stderr, "No filename extension given - defaulting to .___\n");
-    }
-    else 
+    if (lock_dir(image_fd, (uint8_t*)dirent, image_buf, bpb, F_WRLCK) < 0)
+	exit(1);
+    if (resize_chain(dirent, (size + clust_size - 1) / clust_size, NULL,
+		     image_buf, bpb) < 0) 
     {
-	*p = '\0';
-	p++;
-	len = strlen(p);
-	if (len > 3) len = 3;
-	memcpy(dirent->deExtension, p, len);
+	fprintf(stderr, "No more space in filesystem\n");
+	exit(1);
     }
 
-    if (strlen(uppername)>8) 
+    /* read the new data straight into the file's clusters */
+    cluster = getushort(dirent->deStartCluster);
+    while (is_valid_cluster(cluster, bpb)) 
     {
-	uppername[8]='\0';
+	bytes = fread(cluster_to_addr(cluster, image_buf, bpb), 1, 
+		      clust_size, fd);
+	total += bytes;
+	if (bytes < clust_size)
+	    break;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
     }
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
 
-    /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
-    putulong(dirent->deFileSize, size);
-
-    /* could also set time and date here if we really
-       cared... */
-}
-
-
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
-
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
-{
-    while (1) 
-    {
-	if (dirent->deName[0] == SLOT_EMPTY) 
-	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
-
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
-	}
-
-	if (dirent->deName[0] == SLOT_DELETED) 
-	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
-	}
-	dirent++;
-    }
+    /* the file may have changed size while we read it */
+    if (total != size)
+	truncate_file(dirent, total, NULL, image_buf, bpb);
+    putulong(dirent->deFileSize, total);
+    lock_dir(image_fd, (uint8_t*)dirent, image_buf, bpb, F_UNLCK);
 }
 
 /* copyin copies a file from a regular file on the filesystem into a
-   file in the FAT-12 memory disk image  */
+   file in the FAT-12 memory disk image.  An existing file is only
+   replaced if overwrite is set */
 
-void copyin(char *infilename, char* outfilename,
-	    uint8_t *image_buf, struct bpb33* bpb)
+void copyin(char *infilename, char* outfilename, int overwrite,
+	    int image_fd, uint8_t *image_buf, struct bpb33* bpb)
 {
     struct direntry *dirent = (void*)1;
+    struct cluster_alloc alloc;
     FILE *fd;
-    uint16_t start_cluster;
+    uint16_t start_cluster, dir_cluster;
     uint32_t size = 0;
 
     assert(strncmp("a:", outfilename, 2)==0);
     outfilename+=2;
 
+    /* hold the FAT lock from the lookups until the entry exists.
+       Everything that adds or removes directory entries takes it
+       first, so nobody can create the same name, or take away the
+       directory, in between. */
+    if (lock_fat(image_fd, bpb, F_WRLCK) < 0)
+	exit(1);
+
     /* check that the file doesn't already exist */
-    dirent = find_file(outfilename, 0, FIND_FILE, image_buf, bpb);
-    if (dirent != NULL) 
+    dirent = find_file(outfilename, 0, FIND_FILE, image_fd, image_buf, bpb);
+    if (dirent == NULL && errno == EISDIR) 
     {
-	fprintf(stderr, "File %s already exists\n", outfilename);
+	fprintf(stderr, "%s is a directory\n", outfilename);
 	exit(1);
     }
+    if (dirent != NULL) 
+    {
+	if (!overwrite) 
+	{
+	    fprintf(stderr, "File %s already exists\n", outfilename);
+	    exit(1);
+	}
+
+	fd = fopen(infilename, "r");
+	if (fd == NULL) 
+	{
+	    fprintf(stderr, "Can't open file %s to copy data in\n",
+		    infilename);
+	    exit(1);
+	}
+	overwrite_file(fd, dirent, image_fd, image_buf, bpb);
+	lock_fat(image_fd, bpb, F_UNLCK);
+	fclose(fd);
+	return;
+    }
 
     /* find the dirent of the directory to put the file in */
-    dirent = find_file(outfilename, 0, FIND_DIR, image_buf, bpb);
+    dirent = find_file(outfilename, 0, FIND_DIR, image_fd, image_buf, bpb);
     if (dirent == NULL) 
     {
 	fprintf(stderr, "Directory does not exists in the disk image\n");
@@ -483,47 +406,344 @@ void copyin(char *infilename, char* outfilename,
 	exit(1);
     }
 
+    /* make sure there's a slot for the directory entry (growing the
+       directory if need be) before we copy anything */
+    dir_cluster = addr_to_cluster((uint8_t*)dirent, image_buf, bpb);
+    if (lock_dir_chain(image_fd, dir_cluster, image_buf, bpb, F_WRLCK) < 0)
+	exit(1);
+    if (reserve_dirents(dirent, 1, image_buf, bpb) < 0) 
+    {
+	fprintf(stderr, "No room in the directory for %s\n", outfilename);
+	exit(1);
+    }
+
     /* do the actual copy in*/
-    start_cluster = copy_in_file(fd, image_buf, bpb, &size);
+    alloc_init(&alloc, 1, image_buf, bpb);
+    start_cluster = copy_in_file(fd, &alloc, 0, image_buf, bpb, &size);
+    alloc_destroy(&alloc);
 
     /* create the directory entry */
     create_dirent(dirent, outfilename, start_cluster, size, image_buf, bpb);
+    lock_dir_chain(image_fd, dir_cluster, image_buf, bpb, F_UNLCK);
+    lock_fat(image_fd, bpb, F_UNLCK);
     
     fclose(fd);
 }
 
+/* appendin adds the contents of a regular file to the end of a file
+   in the FAT-12 memory disk image, creating it if it isn't there */
+
+void appendin(char *infilename, char* outfilename,
+	      int image_fd, uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct direntry *dirent;
+    FILE *fd;
+    uint8_t *buf;
+    size_t bytes;
+
+    /* copyin takes the FAT lock again, which changes nothing, and
+       drops it when the file is made */
+    if (lock_fat(image_fd, bpb, F_WRLCK) < 0)
+	exit(1);
+    dirent = find_file(outfilename + 2, 0, FIND_FILE, image_fd, 
+		       image_buf, bpb);
+    if (dirent == NULL) 
+    {
+	copyin(infilename, outfilename, 0, image_fd, image_buf, bpb);
+	return;
+    }
+
+    fd = fopen(infilename, "r");
+    if (fd == NULL) 
+    {
+	fprintf(stderr, "Can't open file %s to copy data in\n",
+		infilename);
+	exit(1);
+    }
+
+    /* after the first chunk the tail comes from the cache, so each
+       chunk costs only what it adds */
+    buf = malloc(PIPELINE_CHUNK);
+    if (lock_dir(image_fd, (uint8_t*)dirent, image_buf, bpb, F_WRLCK) < 0)
+	exit(1);
+    while ((bytes = fread(buf, 1, PIPELINE_CHUNK, fd)) > 0) 
+    {
+	if (append_file(dirent, buf, bytes, image_buf, bpb) < 0) 
+	{
+	    fprintf(stderr, "No more space in filesystem\n");
+	    exit(1);
+	}
+    }
+    lock_dir(image_fd, (uint8_t*)dirent, image_buf, bpb, F_UNLCK);
+    lock_fat(image_fd, bpb, F_UNLCK);
+
+    free(buf);
+    fclose(fd);
+}
+
+/* state shared by the threads of a multi-file copy in */
+struct ingest
+{
+    char **infilenames;		/* host files to copy in */
+    char **outfilenames;	/* their names inside the image */
+    struct direntry *dir;	/* first dirent of the target directory */
+    int nfiles;
+    int next;			/* next file to hand out */
+    struct cluster_alloc alloc;
+    pthread_mutex_t dir_lock;	/* serialises directory updates */
+    uint8_t *image_buf;
+    struct bpb33 *bpb;
+};
+
+struct ingest_worker
+{
+    struct ingest *ingest;
+    int group;			/* this thread's allocation group */
+};
+
+void *ingest_thread(void *arg)
+{
+    struct ingest_worker *worker = arg;
+    struct ingest *ingest = worker->ingest;
+    int n;
+
+    while ((n = __atomic_fetch_add(&ingest->next, 1, __ATOMIC_RELAXED))
+	   < ingest->nfiles) 
+    {
+	FILE *fd;
+	uint16_t start_cluster;
+	uint32_t size = 0;
+
+	fd = fopen(ingest->infilenames[n], "r");
+	if (fd == NULL) 
+	{
+	    fprintf(stderr, "Can't open file %s to copy data in\n",
+		    ingest->infilenames[n]);
+	    exit(1);
+	}
+
+	/* the data and the FAT chain can go in concurrently ... */
+	start_cluster = copy_in_file(fd, &ingest->alloc, worker->group,
+				     ingest->image_buf, ingest->bpb, &size);
+	fclose(fd);
+
+	/* ... but only one thread at a time may touch the directory */
+	pthread_mutex_lock(&ingest->dir_lock);
+	create_dirent(ingest->dir, ingest->outfilenames[n], start_cluster,
+		      size, ingest->image_buf, ingest->bpb);
+	pthread_mutex_unlock(&ingest->dir_lock);
+    }
+    return NULL;
+}
+
+/* copyin_many copies several regular files into one directory of the
+   disk image, using nthreads threads */
+
+void copyin_many(char **infilenames, int nfiles, char *outdirname,
+		 int nthreads, int image_fd, 
+		 uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct ingest ingest;
+    struct ingest_worker *workers;
+    pthread_t *threads;
+    uint16_t dir_cluster;
+    char *base;
+    int i, len;
+
+    assert(strncmp("a:", outdirname, 2)==0);
+    outdirname+=2;
+
+    if (nthreads < 1)
+	nthreads = 1;
+    if (nthreads > nfiles)
+	nthreads = nfiles;
+
+    memset(&ingest, 0, sizeof(ingest));
+    ingest.infilenames = infilenames;
+    ingest.nfiles = nfiles;
+    ingest.image_buf = image_buf;
+    ingest.bpb = bpb;
+    ingest.outfilenames = malloc(nfiles * sizeof(char *));
+
+    /* the locks are per process, so take them once for all the
+       threads, and before the lookups so the names stay free */
+    if (lock_fat(image_fd, bpb, F_WRLCK) < 0)
+	exit(1);
+
+    /* work out every target name, and check them all before we
+       start writing anything */
+    for (i = 0; i < nfiles; i++) 
+    {
+	base = strrchr(infilenames[i], '/');
+	base = base ? base + 1 : infilenames[i];
+	len = strlen(outdirname) + strlen(base) + 2;
+	ingest.outfilenames[i] = malloc(len);
+	snprintf(ingest.outfilenames[i], len, "%s/%s", outdirname, base);
+
+	if (find_file(ingest.outfilenames[i], 0, FIND_FILE, 
+		      image_fd, image_buf, bpb) != NULL || errno == EISDIR) 
+	{
+	    fprintf(stderr, "File %s already exists\n", 
+		    ingest.outfilenames[i]);
+	    exit(1);
+	}
+    }
+
+    ingest.dir = find_file(ingest.outfilenames[0], 0, FIND_DIR, 
+			   image_fd, image_buf, bpb);
+    if (ingest.dir == NULL) 
+    {
+	fprintf(stderr, "Directory does not exists in the disk image\n");
+	exit(1);
+    }
+
+    /* grow the directory up front, so the threads never have to
+       allocate clusters for it */
+    dir_cluster = addr_to_cluster((uint8_t*)ingest.dir, image_buf, bpb);
+    if (lock_dir_chain(image_fd, dir_cluster, image_buf, bpb, F_WRLCK) < 0)
+	exit(1);
+    if (reserve_dirents(ingest.dir, nfiles, image_buf, bpb) < 0) 
+    {
+	fprintf(stderr, "No room in the directory for %d files\n", nfiles);
+	exit(1);
+    }
+    alloc_init(&ingest.alloc, nthreads, image_buf, bpb);
+    pthread_mutex_init(&ingest.dir_lock, NULL);
+
+    workers = malloc(nthreads * sizeof(struct ingest_worker));
+    threads = malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) 
+    {
+	workers[i].ingest = &ingest;
+	workers[i].group = i;
+	if (pthread_create(&threads[i], NULL, ingest_thread, &workers[i]) != 0) 
+	{
+	    fprintf(stderr, "Failed to start copy thread: %s\n", 
+		    strerror(errno));
+	    exit(1);
+	}
+    }
+    for (i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    lock_dir_chain(image_fd, dir_cluster, image_buf, bpb, F_UNLCK);
+    lock_fat(image_fd, bpb, F_UNLCK);
+
+    pthread_mutex_destroy(&ingest.dir_lock);
+    alloc_destroy(&ingest.alloc);
+    for (i = 0; i < nfiles; i++)
+	free(ingest.outfilenames[i]);
+    free(ingest.outfilenames);
+    free(workers);
+    free(threads);
+}
+
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename> a:<filename1> <filename2>\n", progname);
+    fprintf(stderr, "usage: %s [-d depth] [-r clusters] <imagename> a:<filename1> <filename2>\n", progname);
     fprintf(stderr, "\tcopies file called filename1 from disk image to a normal file\n");
-    fprintf(stderr, "usage: %s <imagename> <filename3> a:<filename4>\n", progname);
+    fprintf(stderr, "\tusing depth read-ahead buffers (0 disables the pipeline)\n");
+    fprintf(stderr, "\tand prefetching clusters of the chain ahead (0 disables)\n");
+    fprintf(stderr, "usage: %s [-f] <imagename> <filename3> a:<filename4>\n", progname);
     fprintf(stderr, "\tcopies normal file called filename3 into disk image as filename4\n");
+    fprintf(stderr, "\t(-f overwrites filename4 in place if it already exists,\n");
+    fprintf(stderr, "\t -a or --append adds to the end of it)\n");
+    fprintf(stderr, "usage: %s [-d depth] [-r clusters] -m <manifest> <imagename>\n", progname);
+    fprintf(stderr, "\tcopies out each a:<filename> <outfilename> pair listed in manifest\n");
+    fprintf(stderr, "usage: %s [-j threads] <imagename> <file>... a:<dirname>\n", progname);
+    fprintf(stderr, "\tcopies several normal files into a directory of the disk image\n");
     exit(1);
 }
 
 int main(int argc, char** argv)
 {
-    int fd;
+    int fd, opt;
+    int depth = DEFAULT_PIPELINE_DEPTH;
+    int window = DEFAULT_READAHEAD;
+    int nthreads = DEFAULT_INGEST_THREADS;
+    int overwrite = 0;
+    int append = 0;
+    char *manifest = NULL;
+    static struct option longopts[] = {
+	{ "append", no_argument, NULL, 'a' },
+	{ NULL, 0, NULL, 0 }
+    };
+    char *imagename, *src, *dst;
     uint8_t *image_buf;
     struct bpb33* bpb;
-    if (argc < 4 || argc > 4) 
+
+    while ((opt = getopt_long(argc, argv, "d:r:j:m:fa", longopts, NULL)) != -1) 
+    {
+	switch (opt) 
+	{
+	case 'a':
+	    append = 1;
+	    break;
+	case 'f':
+	    overwrite = 1;
+	    break;
+	case 'm':
+	    manifest = optarg;
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'd':
+	    depth = atoi(optarg);
+	    break;
+	case 'r':
+	    window = atoi(optarg);
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (manifest != NULL) 
+    {
+	int status;
+	if (argc - optind != 1) 
+	{
+	    usage(argv[0]);
+	}
+	image_buf = mmap_file(argv[optind], &fd);
+	bpb = check_bootsector(image_buf);
+	status = copyout_manifest(manifest, depth, window, fd, image_buf, bpb);
+	unmmap_file(image_buf, &fd);
+	return status;
+    }
+    if (argc - optind > 3 && strncmp("a:", argv[argc - 1], 2)==0) 
+    {
+	/* several files into one directory of the disk image */
+	image_buf = mmap_file(argv[optind], &fd);
+	bpb = check_bootsector(image_buf);
+	copyin_many(&argv[optind + 1], argc - optind - 2, argv[argc - 1],
+		    nthreads, fd, image_buf, bpb);
+	unmmap_file(image_buf, &fd);
+	return 0;
+    }
+    if (argc - optind != 3) 
     {
 	usage(argv[0]);
     }
+    imagename = argv[optind];
+    src = argv[optind + 1];
+    dst = argv[optind + 2];
 
-    image_buf = mmap_file(argv[1], &fd);
+    image_buf = mmap_file(imagename, &fd);
     bpb = check_bootsector(image_buf);
 
     /* use the "a:" bit to determine whether we're copying in or out */
-    if (strncmp("a:", argv[2], 2)==0) 
+    if (strncmp("a:", src, 2)==0) 
     {
 	/* copy from FAT-12 disk image to external filesystem */
-	copyout(argv[2], argv[3], image_buf, bpb);
+	copyout(src, dst, depth, window, fd, image_buf, bpb);
     }
-    else if (strncmp("a:", argv[3], 2)==0) 
+    else if (strncmp("a:", dst, 2)==0) 
     {
 	/* copy from external filesystem to FAT-12 disk image */
-	copyin(argv[2], argv[3], image_buf, bpb);
+	if (append)
+	    appendin(src, dst, fd, image_buf, bpb);
+	else
+	    copyin(src, dst, overwrite, fd, image_buf, bpb);
     } 
     else 
     {
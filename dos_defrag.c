@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* a file that needs moving */
+struct candidate
+{
+    struct direntry *dirent;
+    uint16_t start;		/* to check it hasn't changed under us */
+    uint32_t clusters;
+    int fragments;
+    int damaged;		/* shared, looped or broken: leave it */
+    char *path;
+};
+
+
+int cmp_candidate(const void *a, const void *b)
+{
+    const struct candidate *ca = a, *cb = b;
+
+    if (ca->clusters != cb->clusters)
+	return ca->clusters < cb->clusters ? -1 : 1;
+    return strcmp(ca->path, cb->path);
+}
+
+
+/* find every fragmented file, and count what points at each cluster */
+struct candidate *find_candidates(int fd, int *n, struct cluster_refs *refs,
+				  uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct dir_iter it;
+    struct dir_rec rec;
+    struct candidate *c = NULL;
+    int cap = 0, fragments;
+    uint32_t clusters;
+    uint16_t start;
+
+    *n = 0;
+    lock_fat(fd, bpb, F_RDLCK);
+    cluster_refs_build(refs, fd, image_buf, bpb);
+    dir_iter_init(&it, 0, fd, image_buf, bpb);
+    while (dir_iter_next(&it, &rec))
+    {
+	if ((rec.dirent->deAttributes & (ATTR_VOLUME | ATTR_DIRECTORY)) != 0)
+	    continue;
+	start = getushort(rec.dirent->deStartCluster);
+	fragments = count_fragments(start, &clusters, image_buf, bpb);
+	if (fragments <= 1)
+	    continue;
+	if (*n == cap)
+	{
+	    cap = cap ? cap * 2 : 64;
+	    c = realloc(c, cap * sizeof(struct candidate));
+	}
+	c[*n].dirent = rec.dirent;
+	c[*n].start = start;
+	c[*n].clusters = clusters;
+	c[*n].fragments = fragments;
+	c[*n].damaged = !chain_movable(start, refs, image_buf, bpb);
+	c[*n].path = strdup(rec.path);
+	(*n)++;
+    }
+    dir_iter_finish(&it);
+    lock_fat(fd, bpb, F_UNLCK);
+    return c;
+}
+
+
+/* defrag moves the fragmented files into contiguous runs, smallest
+   first, so the most files get fixed for the least I/O.  It stops
+   once it's been going for seconds, or once the next file would take
+   it past max_clusters moved.  Each file is moved under its own hold
+   on the FAT, so other tools get a look in between files.  A file
+   whose chain is shared with another, loops, or runs off the disk is
+   left where it is: moving it would lose data.  scandisk sorts those
+   out. */
+void defrag(int fd, int dry_run, int seconds, long max_clusters,
+	    uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct candidate *c;
+    struct cluster_refs refs;
+    int n, i, result, moved = 0, nofit = 0, damaged = 0, changed = 0;
+    long clusters_moved = 0;
+    time_t started = time(NULL);
+
+    c = find_candidates(fd, &n, &refs, image_buf, bpb);
+    qsort(c, n, sizeof(struct candidate), cmp_candidate);
+
+    for (i = 0; i < n; i++)
+    {
+	if (c[i].damaged)
+	{
+	    printf("Won't move %s: its chain is damaged or shared\n", 
+		   c[i].path);
+	    damaged++;
+	    continue;
+	}
+	if (seconds > 0 && time(NULL) - started >= seconds)
+	{
+	    printf("Out of time\n");
+	    break;
+	}
+	if (max_clusters > 0 && clusters_moved + c[i].clusters > max_clusters)
+	{
+	    printf("Reached the limit of %ld clusters moved\n", max_clusters);
+	    break;
+	}
+	if (dry_run)
+	{
+	    printf("would move %s (%d fragments, %u clusters)\n", c[i].path,
+		   c[i].fragments, c[i].clusters);
+	    continue;
+	}
+
+	if (lock_fat(fd, bpb, F_WRLCK) < 0 ||
+	    lock_dir(fd, (uint8_t*)c[i].dirent, image_buf, bpb, F_WRLCK) < 0)
+	    exit(1);
+	if (c[i].dirent->deName[0] == SLOT_DELETED ||
+	    getushort(c[i].dirent->deStartCluster) != c[i].start)
+	{
+	    /* somebody else got to it first */
+	    changed++;
+	}
+	else if ((result = move_chain(c[i].dirent, CLUST_FIRST, &refs, 
+				      image_buf, bpb)) < 0)
+	{
+	    printf("Won't move %s: its chain is damaged or shared\n", 
+		   c[i].path);
+	    damaged++;
+	}
+	else if (result == 0)
+	{
+	    printf("No room to move %s (%u clusters)\n", c[i].path, 
+		   c[i].clusters);
+	    nofit++;
+	}
+	else
+	{
+	    printf("moved %s (%d fragments, %u clusters)\n", c[i].path,
+		   c[i].fragments, c[i].clusters);
+	    moved++;
+	    clusters_moved += c[i].clusters;
+	}
+	lock_dir(fd, (uint8_t*)c[i].dirent, image_buf, bpb, F_UNLCK);
+	lock_fat(fd, bpb, F_UNLCK);
+    }
+
+    printf("%d fragmented files, %d moved (%ld clusters), %d didn't fit, "
+	   "%d damaged, %d changed while we worked\n", n, moved, 
+	   clusters_moved, nofit, damaged, changed);
+    cluster_refs_free(&refs);
+    for (i = 0; i < n; i++)
+	free(c[i].path);
+    free(c);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-n] [-t seconds] [-b clusters] <imagename>\n", progname);
+    fprintf(stderr, "\tmoves each fragmented file into one contiguous run, smallest\n");
+    fprintf(stderr, "\tfirst, for at most seconds and clusters moved; -n only lists\n");
+    fprintf(stderr, "\twhat would be moved\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt;
+    int dry_run = 0;
+    int seconds = 0;
+    long max_clusters = 0;
+    struct bpb33* bpb;
+
+    while ((opt = getopt(argc, argv, "nt:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            dry_run = 1;
+            break;
+        case 't':
+            seconds = atoi(optarg);
+            break;
+        case 'b':
+            max_clusters = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+    {
+	usage(argv[0]);
+    }
+
+    image_buf = mmap_file(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    defrag(fd, dry_run, seconds, max_clusters, image_buf, bpb);
+
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    return 0;
+}
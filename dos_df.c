@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+void print_usage(char *imagename, struct fat_usage *fu, struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    int i;
+
+    printf("%s: %u clusters of %u bytes\n", imagename, fu->clusters,
+	   clust_size);
+    printf("  used: %8u clusters %10llu bytes\n", fu->used, 
+	   (unsigned long long)fu->used * clust_size);
+    printf("  free: %8u clusters %10llu bytes\n", fu->free, 
+	   (unsigned long long)fu->free * clust_size);
+    printf("  bad:  %8u clusters %10llu bytes\n", fu->bad, 
+	   (unsigned long long)fu->bad * clust_size);
+    printf("  free extents: %u, largest %u clusters at cluster %u\n",
+	   fu->nextents, fu->largest_free, fu->largest_free_start);
+    for (i = 0; i < FAT_USAGE_BUCKETS; i++)
+    {
+	if (fu->extents[i] == 0)
+	    continue;
+	printf("    %5u - %5u clusters: %u\n", 1u << i, (2u << i) - 1,
+	       fu->extents[i]);
+    }
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s <imagename>...\n", progname);
+    fprintf(stderr, "\tshows used, free and bad space, and how the free space\n");
+    fprintf(stderr, "\tis broken up, for each image\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, i;
+    struct bpb33* bpb;
+    struct fat_usage fu;
+
+    if (argc < 2)
+    {
+	usage(argv[0]);
+    }
+
+    for (i = 1; i < argc; i++)
+    {
+	image_buf = mmap_file(argv[i], &fd);
+	bpb = check_bootsector(image_buf);
+
+	lock_fat(fd, bpb, F_RDLCK);
+	fat_usage(&fu, image_buf, bpb);
+	lock_fat(fd, bpb, F_UNLCK);
+	print_usage(argv[i], &fu, bpb);
+
+	unmmap_file(image_buf, &fd);
+	free(bpb);
+    }
+    return 0;
+}
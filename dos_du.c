@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+#define DEFAULT_TOP 10
+
+
+/* space used by a directory subtree */
+struct usage
+{
+    char *path;
+    int depth;
+    uint64_t logical;		/* bytes in the files */
+    uint64_t allocated;		/* bytes in clusters, directories too */
+    uint64_t slack;		/* allocated to files but not used */
+};
+
+/* one of the largest files seen so far */
+struct big_file
+{
+    uint32_t size;
+    uint32_t slack;		/* allocated but not used */
+    char *path;
+};
+
+/* the largest files are kept in a min-heap of at most top entries, so
+   the smallest of them is always at the root, ready to be pushed out */
+static struct big_file *heap;
+static int heap_len = 0;
+static int top = DEFAULT_TOP;
+static int all_files = 0;	/* -a: a line for every file too */
+
+
+void heap_sift_down(int i)
+{
+    struct big_file tmp;
+    int smallest, l, r;
+
+    while (1)
+    {
+	smallest = i;
+	l = 2 * i + 1;
+	r = l + 1;
+	if (l < heap_len && heap[l].size < heap[smallest].size)
+	    smallest = l;
+	if (r < heap_len && heap[r].size < heap[smallest].size)
+	    smallest = r;
+	if (smallest == i)
+	    return;
+	tmp = heap[i];
+	heap[i] = heap[smallest];
+	heap[smallest] = tmp;
+	i = smallest;
+    }
+}
+
+
+void heap_offer(uint32_t size, uint32_t slack, char *path)
+{
+    struct big_file tmp;
+    int i, parent;
+
+    if (top <= 0)
+	return;
+    if (heap_len < top)
+    {
+	/* still room: add it at the bottom and sift it up */
+	i = heap_len++;
+	heap[i].size = size;
+	heap[i].slack = slack;
+	heap[i].path = strdup(path);
+	while (i > 0)
+	{
+	    parent = (i - 1) / 2;
+	    if (heap[parent].size <= heap[i].size)
+		break;
+	    tmp = heap[i];
+	    heap[i] = heap[parent];
+	    heap[parent] = tmp;
+	    i = parent;
+	}
+    }
+    else if (size > heap[0].size)
+    {
+	/* bigger than the smallest we're keeping: replace it */
+	free(heap[0].path);
+	heap[0].size = size;
+	heap[0].slack = slack;
+	heap[0].path = strdup(path);
+	heap_sift_down(0);
+    }
+}
+
+
+/* count the clusters in a chain */
+uint32_t chain_clusters(uint16_t cluster, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t total_clusters = bpb->bpbSectors / bpb->bpbSecPerClust;
+    uint32_t n = 0;
+
+    while (is_valid_cluster(cluster, bpb) && n < total_clusters)
+    {
+	n++;
+	cluster = get_fat_entry(cluster, image_buf, bpb);
+    }
+    return n;
+}
+
+
+void print_usage(struct usage *u)
+{
+    printf("%12llu %12llu %12llu  %s\n", 
+	   (unsigned long long)u->allocated, (unsigned long long)u->logical,
+	   (unsigned long long)u->slack, u->depth < 0 ? "/" : u->path);
+}
+
+
+/* close the innermost open directory, adding its totals to its
+   parent's */
+void close_dir(struct usage *stack, int *n)
+{
+    struct usage *u = &stack[--(*n)];
+
+    print_usage(u);
+    free(u->path);
+    if (*n > 0)
+    {
+	stack[*n - 1].logical += u->logical;
+	stack[*n - 1].allocated += u->allocated;
+	stack[*n - 1].slack += u->slack;
+    }
+}
+
+
+/* du walks the tree once.  Directories are kept on a stack while
+   their contents go by, and each one's totals are printed (children
+   before parents, as du does) and passed up to its parent as soon as
+   the walk leaves it.  With -a each file gets a line of its own as
+   it goes by. */
+void du(int fd, int nthreads, uint8_t *image_buf, struct bpb33 *bpb)
+{
+    uint32_t clust_size = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    struct dir_iter it;
+    struct dir_rec rec;
+    struct usage *stack;
+    int n = 0, cap = 16, i;
+    uint32_t size, clusters, slack;
+    uint64_t allocated;
+    uint8_t attr;
+
+    stack = malloc(cap * sizeof(struct usage));
+    memset(&stack[0], 0, sizeof(struct usage));
+    stack[0].depth = -1;
+    n = 1;
+
+    printf("%12s %12s %12s  %s\n", "allocated", "logical", "slack", "path");
+    dir_iter_init_parallel(&it, 0, nthreads, fd, image_buf, bpb);
+    while (dir_iter_next(&it, &rec))
+    {
+	while (stack[n - 1].depth >= rec.depth)
+	    close_dir(stack, &n);
+
+	attr = rec.dirent->deAttributes;
+	if ((attr & ATTR_VOLUME) != 0)
+	    continue;
+	clusters = chain_clusters(getushort(rec.dirent->deStartCluster),
+				  image_buf, bpb);
+	if ((attr & ATTR_DIRECTORY) != 0)
+	{
+	    if (rec.loop)
+		continue;
+	    if (n == cap)
+	    {
+		cap *= 2;
+		stack = realloc(stack, cap * sizeof(struct usage));
+	    }
+	    memset(&stack[n], 0, sizeof(struct usage));
+	    stack[n].path = strdup(rec.path);
+	    stack[n].depth = rec.depth;
+	    stack[n].allocated = (uint64_t)clusters * clust_size;
+	    n++;
+	    continue;
+	}
+
+	size = getulong(rec.dirent->deFileSize);
+	allocated = (uint64_t)clusters * clust_size;
+	slack = allocated > size ? allocated - size : 0;
+	stack[n - 1].logical += size;
+	stack[n - 1].allocated += allocated;
+	stack[n - 1].slack += slack;
+	if (all_files)
+	    printf("%12llu %12u %12u  %s\n", (unsigned long long)allocated,
+		   size, slack, rec.path);
+	heap_offer(size, slack, rec.path);
+    }
+    dir_iter_finish(&it);
+
+    while (n > 0)
+	close_dir(stack, &n);
+    free(stack);
+
+    /* pull the largest files off the heap, smallest first, and print
+       them the other way round */
+    if (heap_len > 0)
+    {
+	int len = heap_len;
+	printf("\nLargest files:\n");
+	printf("%12s %12s  %s\n", "size", "slack", "path");
+	while (heap_len > 0)
+	{
+	    struct big_file tmp = heap[0];
+	    heap[0] = heap[--heap_len];
+	    heap[heap_len] = tmp;
+	    heap_sift_down(0);
+	}
+	for (i = 0; i < len; i++)
+	{
+	    printf("%12u %12u  %s\n", heap[i].size, heap[i].slack, 
+		   heap[i].path);
+	    free(heap[i].path);
+	}
+    }
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-a] [-j threads] [-n count] <imagename>\n", progname);
+    fprintf(stderr, "\tshows the space used under each directory, and the\n");
+    fprintf(stderr, "\tcount largest files (default %d); -a shows every\n", DEFAULT_TOP);
+    fprintf(stderr, "\tfile as well\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt;
+    int nthreads = 1;
+    struct bpb33* bpb;
+
+    while ((opt = getopt(argc, argv, "aj:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            all_files = 1;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            top = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+    {
+	usage(argv[0]);
+    }
+    heap = malloc((top > 0 ? top : 1) * sizeof(struct big_file));
+
+    image_buf = mmap_file(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    /* hold the FAT still while we follow chains */
+    lock_fat(fd, bpb, F_RDLCK);
+    du(fd, nthreads, image_buf, bpb);
+    lock_fat(fd, bpb, F_UNLCK);
+
+    unmmap_file(image_buf, &fd);
+    free(heap);
+    free(bpb);
+    return 0;
+}
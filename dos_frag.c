@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+#define DEFAULT_WORST 10
+#define FRAG_BUCKETS 12
+
+
+/* a badly fragmented file */
+struct offender
+{
+    int fragments;
+    uint32_t clusters;
+    char *path;
+};
+
+/* the worst files so far, most fragments first */
+static struct offender *worst;
+static int nworst = 0;
+static int maxworst = DEFAULT_WORST;
+
+
+/* keep the file if it's among the worst maxworst seen so far.  The
+   list is short, so it's kept sorted by insertion. */
+void note_offender(int fragments, uint32_t clusters, char *path)
+{
+    int i;
+
+    if (maxworst <= 0 || fragments <= 1)
+	return;
+    if (nworst == maxworst)
+    {
+	if (fragments <= worst[nworst - 1].fragments)
+	    return;
+	free(worst[--nworst].path);
+    }
+    for (i = nworst; i > 0 && worst[i - 1].fragments < fragments; i--)
+	worst[i] = worst[i - 1];
+    worst[i].fragments = fragments;
+    worst[i].clusters = clusters;
+    worst[i].path = strdup(path);
+    nworst++;
+}
+
+
+void frag(int fd, int nthreads, int quiet, uint8_t *image_buf, 
+	  struct bpb33 *bpb)
+{
+    struct dir_iter it;
+    struct dir_rec rec;
+    uint32_t hist[FRAG_BUCKETS];
+    uint32_t clusters, files = 0, fragmented = 0;
+    uint64_t total_clusters = 0, total_fragments = 0;
+    int fragments, bucket, i;
+
+    memset(hist, 0, sizeof(hist));
+    if (!quiet)
+	printf("%9s %9s %11s  %s\n", "fragments", "clusters", "avg extent",
+	       "path");
+
+    dir_iter_init_parallel(&it, 0, nthreads, fd, image_buf, bpb);
+    while (dir_iter_next(&it, &rec))
+    {
+	if ((rec.dirent->deAttributes & (ATTR_VOLUME | ATTR_DIRECTORY)) != 0)
+	    continue;
+
+	/* one walk of the chain gives both counts */
+	fragments = count_fragments(getushort(rec.dirent->deStartCluster),
+				    &clusters, image_buf, bpb);
+	if (fragments == 0)
+	    continue;
+	files++;
+	total_clusters += clusters;
+	total_fragments += fragments;
+	if (fragments > 1)
+	    fragmented++;
+	for (bucket = 0; bucket < FRAG_BUCKETS - 1 && 
+		 (fragments >> (bucket + 1)) != 0; bucket++)
+	    ;
+	hist[bucket]++;
+	note_offender(fragments, clusters, rec.path);
+
+	if (!quiet)
+	    printf("%9d %9u %11.1f  %s\n", fragments, clusters, 
+		   (double)clusters / fragments, rec.path);
+    }
+    dir_iter_finish(&it);
+
+    printf("\n%u files, %u fragmented (%.1f%%), %.2f fragments per file, "
+	   "average extent %.1f clusters\n", files, fragmented,
+	   files ? 100.0 * fragmented / files : 0.0,
+	   files ? (double)total_fragments / files : 0.0,
+	   total_fragments ? (double)total_clusters / total_fragments : 0.0);
+    printf("Files by fragment count:\n");
+    for (i = 0; i < FRAG_BUCKETS; i++)
+    {
+	if (hist[i] == 0)
+	    continue;
+	if (i == 0)
+	    printf("  %13d: %u\n", 1, hist[i]);
+	else
+	    printf("  %5d - %5d: %u\n", 1 << i, (2 << i) - 1, hist[i]);
+    }
+    if (nworst > 0)
+    {
+	printf("Worst offenders:\n");
+	for (i = 0; i < nworst; i++)
+	{
+	    printf("  %9d fragments %9u clusters  %s\n", worst[i].fragments,
+		   worst[i].clusters, worst[i].path);
+	    free(worst[i].path);
+	}
+    }
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-q] [-j threads] [-n count] <imagename>\n", progname);
+    fprintf(stderr, "\treports how fragmented each file is, then the volume as a whole\n");
+    fprintf(stderr, "\tand the count worst files (default %d); -q skips the per-file lines\n", DEFAULT_WORST);
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt;
+    int nthreads = 1;
+    int quiet = 0;
+    struct bpb33* bpb;
+
+    while ((opt = getopt(argc, argv, "qj:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'q':
+            quiet = 1;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'n':
+            maxworst = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+    {
+	usage(argv[0]);
+    }
+    worst = malloc((maxworst > 0 ? maxworst : 1) * sizeof(struct offender));
+
+    image_buf = mmap_file(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    /* hold the FAT still while we follow chains */
+    lock_fat(fd, bpb, F_RDLCK);
+    frag(fd, nthreads, quiet, image_buf, bpb);
+    lock_fat(fd, bpb, F_UNLCK);
+
+    unmmap_file(image_buf, &fd);
+    free(worst);
+    free(bpb);
+    return 0;
+}
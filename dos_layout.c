@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* a file from the trace, in the order it was first read */
+struct hot_file
+{
+    char *path;
+    int order;
+};
+
+
+int cmp_hot_path(const void *a, const void *b)
+{
+    const struct hot_file *ha = a, *hb = b;
+    int c = strcmp(ha->path, hb->path);
+
+    if (c != 0)
+	return c;
+    return ha->order - hb->order;
+}
+
+
+int cmp_hot_order(const void *a, const void *b)
+{
+    return ((const struct hot_file *)a)->order 
+	- ((const struct hot_file *)b)->order;
+}
+
+
+/* read the trace, keeping the first read of each file */
+struct hot_file *read_trace(char *tracename, int *n)
+{
+    FILE *fd;
+    char *line = NULL, *p;
+    size_t linecap = 0;
+    struct hot_file *hot = NULL;
+    unsigned start, clusters;
+    int cap = 0, i, j, len;
+
+    *n = 0;
+    fd = fopen(tracename, "r");
+    if (fd == NULL)
+    {
+	fprintf(stderr, "Can't open trace file %s\n", tracename);
+	exit(1);
+    }
+    while (getline(&line, &linecap, fd) > 0)
+    {
+	if (sscanf(line, "read %u %u %n", &start, &clusters, &len) < 2)
+	    continue;
+	p = line + len;
+	p[strcspn(p, "\r\n")] = '\0';
+	if (*p == '\0')
+	    continue;
+	if (*n == cap)
+	{
+	    cap = cap ? cap * 2 : 64;
+	    hot = realloc(hot, cap * sizeof(struct hot_file));
+	}
+	hot[*n].path = strdup(p);
+	for (i = 0; hot[*n].path[i] != '\0'; i++)
+	    hot[*n].path[i] = toupper(hot[*n].path[i]);
+	hot[*n].order = *n;
+	(*n)++;
+    }
+    free(line);
+    fclose(fd);
+
+    /* drop repeats, then put them back in trace order */
+    qsort(hot, *n, sizeof(struct hot_file), cmp_hot_path);
+    for (i = 0, j = 0; i < *n; i++)
+    {
+	if (j > 0 && strcmp(hot[j - 1].path, hot[i].path) == 0)
+	{
+	    free(hot[i].path);
+	    continue;
+	}
+	hot[j++] = hot[i];
+    }
+    *n = j;
+    qsort(hot, *n, sizeof(struct hot_file), cmp_hot_order);
+    return hot;
+}
+
+
+/* layout lays the traced files out one after another, in the order
+   they were first read.  If there's a free run big enough for all of
+   them, they go there; otherwise each goes in the first run after the
+   one before that will take it.  A file that's already contiguous and
+   right where it should be is left alone, and so is one whose chain
+   is damaged or shared with another: moving it would lose data. */
+void layout(int fd, char *tracename, int dry_run, 
+	    uint8_t *image_buf, struct bpb33 *bpb)
+{
+    struct hot_file *hot;
+    struct direntry **dirents;
+    struct cluster_refs refs;
+    char **paths;
+    uint32_t clusters, total = 0;
+    uint16_t hint, start, dest;
+    int n, i, result, moved = 0, placed = 0, nofit = 0, damaged = 0;
+
+    hot = read_trace(tracename, &n);
+    paths = malloc((n ? n : 1) * sizeof(char *));
+    dirents = malloc((n ? n : 1) * sizeof(struct direntry *));
+    for (i = 0; i < n; i++)
+	paths[i] = hot[i].path;
+
+    if (lock_fat(fd, bpb, F_WRLCK) < 0)
+	exit(1);
+    cluster_refs_build(&refs, fd, image_buf, bpb);
+    find_files(paths, n, dirents, fd, image_buf, bpb);
+    for (i = 0; i < n; i++)
+    {
+	if (dirents[i] == NULL)
+	{
+	    fprintf(stderr, "%s is no longer in the disk image\n", paths[i]);
+	    continue;
+	}
+	if (!chain_movable(getushort(dirents[i]->deStartCluster), &refs,
+			   image_buf, bpb))
+	    continue;
+	count_fragments(getushort(dirents[i]->deStartCluster), &clusters,
+			image_buf, bpb);
+	total += clusters;
+    }
+
+    /* see if they're laid out already */
+    hint = 0;
+    for (i = 0; i < n; i++)
+    {
+	if (dirents[i] == NULL)
+	    continue;
+	start = getushort(dirents[i]->deStartCluster);
+	if (count_fragments(start, &clusters, image_buf, bpb) > 1 ||
+	    (hint != 0 && start != hint))
+	    break;
+	if (clusters > 0)
+	    hint = start + clusters;
+    }
+    if (i == n)
+    {
+	printf("%d traced files, all in place already\n", n);
+	goto out;
+    }
+
+    hint = find_free_extent(total, CLUST_FIRST, &refs, image_buf, bpb);
+    if (hint == 0)
+    {
+	printf("No free run of %u clusters; placing files one by one\n",
+	       total);
+	hint = CLUST_FIRST;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+	if (dirents[i] == NULL)
+	    continue;
+	start = getushort(dirents[i]->deStartCluster);
+	if (count_fragments(start, &clusters, image_buf, bpb) == 0)
+	    continue;
+	if (count_fragments(start, NULL, image_buf, bpb) == 1 && 
+	    start == hint)
+	{
+	    placed++;
+	    hint = start + clusters;
+	    continue;
+	}
+	if (dry_run)
+	{
+	    /* find the run move_chain would, and hold it so the next
+	       file goes after it */
+	    if (!chain_movable(start, &refs, image_buf, bpb))
+	    {
+		printf("Won't move %s: its chain is damaged or shared\n", 
+		       paths[i]);
+		damaged++;
+		continue;
+	    }
+	    dest = find_free_extent(clusters, hint, &refs, image_buf, bpb);
+	    if (dest == 0)
+	    {
+		printf("No room to move %s (%u clusters)\n", paths[i], 
+		       clusters);
+		nofit++;
+		continue;
+	    }
+	    printf("would move %s (%u clusters) to cluster %u\n", paths[i],
+		   clusters, dest);
+	    memset(refs.count + dest, 1, clusters);
+	    hint = dest + clusters;
+	    continue;
+	}
+
+	if (lock_dir(fd, (uint8_t*)dirents[i], image_buf, bpb, F_WRLCK) < 0)
+	    exit(1);
+	if ((result = move_chain(dirents[i], hint, &refs, 
+				 image_buf, bpb)) < 0)
+	{
+	    printf("Won't move %s: its chain is damaged or shared\n", 
+		   paths[i]);
+	    damaged++;
+	}
+	else if (result == 0)
+	{
+	    printf("No room to move %s (%u clusters)\n", paths[i], clusters);
+	    nofit++;
+	}
+	else
+	{
+	    start = getushort(dirents[i]->deStartCluster);
+	    printf("moved %s (%u clusters) to cluster %u\n", paths[i],
+		   clusters, start);
+	    hint = start + clusters;
+	    moved++;
+	}
+	lock_dir(fd, (uint8_t*)dirents[i], image_buf, bpb, F_UNLCK);
+    }
+    printf("%d traced files, %d moved, %d already in place, %d didn't fit, "
+	   "%d damaged\n", n, moved, placed, nofit, damaged);
+
+ out:
+    lock_fat(fd, bpb, F_UNLCK);
+    cluster_refs_free(&refs);
+    for (i = 0; i < n; i++)
+	free(hot[i].path);
+    free(hot);
+    free(paths);
+    free(dirents);
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-n] <imagename> <tracefile>\n", progname);
+    fprintf(stderr, "\tputs the files read in tracefile (written by the tools when\n");
+    fprintf(stderr, "\tDOS_TRACE is set) next to each other in the order they were\n");
+    fprintf(stderr, "\tread; -n only lists what would be moved\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt;
+    int dry_run = 0;
+    struct bpb33* bpb;
+
+    while ((opt = getopt(argc, argv, "n")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            dry_run = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+    {
+	usage(argv[0]);
+    }
+
+    image_buf = mmap_file(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    layout(fd, argv[optind + 1], dry_run, image_buf, bpb);
+
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    return 0;
+}
@@ -7,6 +7,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdarg.h>
+#include <getopt.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -119,50 +121,183 @@ uint16_t print_dirent(struct direntry *dirent, int indent)
 }
 
 
-void follow_dir(uint16_t cluster, int indent,
-		uint8_t *image_buf, struct bpb33* bpb)
+/* The machine readable formats.  Every record is built up in one big
+   output buffer, which goes out in a single write when it fills. */
+
+#define FORMAT_TEXT 0
+#define FORMAT_JSON 1
+#define FORMAT_CSV  2
+#define FORMAT_NUL  3
+
+#define OUTBUF_SIZE (1024*1024)
+
+static char outbuf[OUTBUF_SIZE];
+static size_t outlen = 0;
+
+
+void out_flush(void)
 {
-    while (is_valid_cluster(cluster, bpb))
-    {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    fwrite(outbuf, 1, outlen, stdout);
+    outlen = 0;
+}
+
+
+void out_printf(const char *fmt, ...)
+{
+    va_list ap;
+    int n;
 
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
+    if (OUTBUF_SIZE - outlen < 4 * MAXPATHLEN)
+	out_flush();
+    va_start(ap, fmt);
+    n = vsnprintf(outbuf + outlen, OUTBUF_SIZE - outlen, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+	outlen += n;
+}
+
+
+/* write s as a quoted string for the format */
+void out_string(char *s, int format)
+{
+    /* at worst every byte becomes a \u00xx escape, and sprintf adds
+       a NUL after the last one; then there are the two quotes */
+    if (OUTBUF_SIZE - outlen < 6 * strlen(s) + 3)
+	out_flush();
+    if (format == FORMAT_NUL) 
+    {
+	out_printf("%s", s);
+	outbuf[outlen++] = '\0';
+	return;
+    }
+    outbuf[outlen++] = '"';
+    for ( ; *s != '\0'; s++) 
+    {
+	unsigned char c = *s;
+	if (format == FORMAT_CSV) 
 	{
-            
-            uint16_t followclust = print_dirent(dirent, indent);
-            if (followclust)
-                follow_dir(followclust, indent+1, image_buf, bpb);
-            dirent++;
+	    if (c == '"')
+		outbuf[outlen++] = '"';
+	    outbuf[outlen++] = c;
 	}
-
-	cluster = get_fat_entry(cluster, image_buf, bpb);
+	else if (c == '"' || c == '\\') 
+	{
+	    outbuf[outlen++] = '\\';
+	    outbuf[outlen++] = c;
+	}
+	else if (c < 0x20 || c >= 0x7f) 
+	{
+	    /* FAT names are in a DOS code page, not UTF-8 */
+	    outlen += sprintf(outbuf + outlen, "\\u%04x", c);
+	}
+	else
+	    outbuf[outlen++] = c;
     }
+    outbuf[outlen++] = '"';
 }
 
 
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
+void print_record(struct dir_rec *rec, int format, int first,
+		  uint8_t *image_buf, struct bpb33 *bpb)
 {
-    uint16_t cluster = 0;
+    struct direntry *dirent = rec->dirent;
+    uint8_t attr = dirent->deAttributes;
+    uint16_t mtime = getushort(dirent->deMTime);
+    uint16_t mdate = getushort(dirent->deMDate);
+    uint16_t cluster = getushort(dirent->deStartCluster);
+    char *type, attrs[5], when[20];
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-    printf("The address of the first dirent is: %lu\n", dirent);
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
+    if ((attr & ATTR_VOLUME) != 0)
+	type = "volume";
+    else if ((attr & ATTR_DIRECTORY) != 0)
+	type = "directory";
+    else
+	type = "file";
+    attrs[0] = (attr & ATTR_READONLY) ? 'r' : '-';
+    attrs[1] = (attr & ATTR_HIDDEN) ? 'h' : '-';
+    attrs[2] = (attr & ATTR_SYSTEM) ? 's' : '-';
+    attrs[3] = (attr & ATTR_ARCHIVE) ? 'a' : '-';
+    attrs[4] = '\0';
+    when[0] = '\0';
+    if (mdate != 0)
+	sprintf(when, "%04d-%02d-%02dT%02d:%02d:%02d",
+		((mdate & DD_YEAR_MASK) >> DD_YEAR_SHIFT) + 1980,
+		(mdate & DD_MONTH_MASK) >> DD_MONTH_SHIFT,
+		(mdate & DD_DAY_MASK) >> DD_DAY_SHIFT,
+		(mtime & DT_HOURS_MASK) >> DT_HOURS_SHIFT,
+		(mtime & DT_MINUTES_MASK) >> DT_MINUTES_SHIFT,
+		((mtime & DT_2SECONDS_MASK) >> DT_2SECONDS_SHIFT) * 2);
+
+    switch (format) 
     {
-        uint16_t followclust = print_dirent(dirent, 0);
-        if (is_valid_cluster(followclust, bpb))
-            follow_dir(followclust, 1, image_buf, bpb);
+    case FORMAT_JSON:
+	out_printf("%s{\"path\":", first ? "" : ",\n");
+	out_string(rec->path, format);
+	out_printf(",\"type\":\"%s\",\"size\":%u,\"start_cluster\":%u,"
+		   "\"attributes\":\"%s\",\"mtime\":", 
+		   type, getulong(dirent->deFileSize), cluster, attrs);
+	if (when[0] != '\0')
+	    out_printf("\"%s\"", when);
+	else
+	    out_printf("null");
+	out_printf(",\"fragments\":%d}", 
+		   count_fragments(cluster, NULL, image_buf, bpb));
+	break;
+    case FORMAT_CSV:
+	out_string(rec->path, format);
+	out_printf(",%s,%u,%u,%s,%s,%d\n", type, 
+		   getulong(dirent->deFileSize), cluster, attrs, when,
+		   count_fragments(cluster, NULL, image_buf, bpb));
+	break;
+    case FORMAT_NUL:
+	out_string(rec->path, format);
+	out_printf("%s%c%u%c%u%c%s%c%s%c%d%c", type, 0,
+		   getulong(dirent->deFileSize), 0, cluster, 0, attrs, 0, 
+		   when, 0, count_fragments(cluster, NULL, image_buf, bpb), 0);
+	break;
+    }
+}
+
+
+void traverse_root(int fd, int format, int nthreads,
+		   uint8_t *image_buf, struct bpb33* bpb)
+{
+    struct dir_iter it;
+    struct dir_rec rec;
+    int first = 1;
 
-        dirent++;
+    if (format == FORMAT_TEXT)
+	printf("The address of the first dirent is: %lu\n", 
+	       root_dir_addr(image_buf, bpb));
+    else if (format == FORMAT_JSON)
+	out_printf("[\n");
+    else if (format == FORMAT_CSV)
+	out_printf("path,type,size,start_cluster,attributes,mtime,fragments\n");
+
+    dir_iter_init_parallel(&it, 0, nthreads, fd, image_buf, bpb);
+    while (dir_iter_next(&it, &rec))
+    {
+	if (format == FORMAT_TEXT)
+	    print_dirent(rec.dirent, rec.depth);
+	else
+	    print_record(&rec, format, first, image_buf, bpb);
+	first = 0;
     }
+    dir_iter_finish(&it);
+
+    if (format == FORMAT_JSON)
+	out_printf("%s]\n", first ? "" : "\n");
+    out_flush();
 }
 
 
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [-j threads] [--format=text|json|csv|nul] <imagename>\n", progname);
+    fprintf(stderr, "\t-j reads directories with several threads; the output is the same\n");
+    fprintf(stderr, "\tjson is an array of objects, csv has a header line, and nul\n");
+    fprintf(stderr, "\tends each of the 7 fields of a record with a NUL byte:\n");
+    fprintf(stderr, "\tpath, type, size, start cluster, attributes, mtime, fragments\n");
     exit(1);
 }
 
@@ -170,17 +305,49 @@ void usage(char *progname)
 int main(int argc, char** argv)
 {
     uint8_t *image_buf;
-    int fd;
+    int fd, opt;
+    int format = FORMAT_TEXT;
+    int nthreads = 1;
     struct bpb33* bpb;
-    if (argc != 2)
+    static struct option longopts[] = {
+	{ "format", required_argument, NULL, 'F' },
+	{ NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "j:", longopts, NULL)) != -1)
+    {
+	if (opt == 'j')
+	{
+	    nthreads = atoi(optarg);
+	    continue;
+	}
+	if (opt != 'F')
+	    usage(argv[0]);
+	if (strcmp(optarg, "text") == 0)
+	    format = FORMAT_TEXT;
+	else if (strcmp(optarg, "json") == 0)
+	    format = FORMAT_JSON;
+	else if (strcmp(optarg, "csv") == 0)
+	    format = FORMAT_CSV;
+	else if (strcmp(optarg, "nul") == 0)
+	    format = FORMAT_NUL;
+	else
+	    usage(argv[0]);
+    }
+    if (argc - optind != 1)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    image_buf = mmap_file(argv[optind], &fd);
     bpb = check_bootsector(image_buf);
-    printf("Root directory address is: %lu\n", root_dir_addr(image_buf, bpb));
-    traverse_root(image_buf, bpb);
+    if (format == FORMAT_TEXT)
+	printf("Root directory address is: %lu\n", root_dir_addr(image_buf, bpb));
+
+    /* hold the FAT still while we follow directory chains */
+    lock_fat(fd, bpb, F_RDLCK);
+    traverse_root(fd, format, nthreads, image_buf, bpb);
+    lock_fat(fd, bpb, F_UNLCK);
 
     unmmap_file(image_buf, &fd);
 
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-p] <imagename> a:<dirname>...\n", progname);
+    fprintf(stderr, "\t-p: make parent directories as needed\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, opt, i;
+    int parents = 0;
+    int status = 0;
+    struct bpb33* bpb;
+
+    while ((opt = getopt(argc, argv, "p")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            parents = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2)
+    {
+	usage(argv[0]);
+    }
+
+    image_buf = mmap_file(argv[optind], &fd);
+    bpb = check_bootsector(image_buf);
+
+    for (i = optind + 1; i < argc; i++)
+    {
+	if (strncmp("a:", argv[i], 2) != 0)
+	{
+	    usage(argv[0]);
+	}
+	if (make_dir(argv[i] + 2, parents, fd, image_buf, bpb) < 0)
+	    status = 1;
+    }
+
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    return status;
+}
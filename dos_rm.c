@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s <imagename> a:<filename>...\n", progname);
+    fprintf(stderr, "\tremoves the named files from the disk image\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd, i, nfiles;
+    int status = 0;
+    struct bpb33* bpb;
+    struct direntry **dirents;
+    uint16_t *clusters = NULL;
+    int nclusters = 0, cap = 0;
+
+    if (argc < 3)
+    {
+	usage(argv[0]);
+    }
+
+    image_buf = mmap_file(argv[1], &fd);
+    bpb = check_bootsector(image_buf);
+
+    /* look everything up first, under the FAT lock so nothing can
+       move or reuse the entries before they are dropped */
+    if (lock_fat(fd, bpb, F_WRLCK) < 0)
+	exit(1);
+    nfiles = argc - 2;
+    dirents = malloc(nfiles * sizeof(struct direntry *));
+    for (i = 0; i < nfiles; i++)
+    {
+	char *filename = argv[i + 2];
+	if (strncmp("a:", filename, 2) != 0)
+	{
+	    usage(argv[0]);
+	}
+	filename += 2;
+
+	dirents[i] = find_file(filename, 0, FIND_FILE, fd, image_buf, bpb);
+	if (dirents[i] == NULL && errno == EISDIR)
+	{
+	    fprintf(stderr, "%s is a directory; not removed\n", filename);
+	    status = 1;
+	}
+	else if (dirents[i] == NULL)
+	{
+	    fprintf(stderr, "No file called %s exists in the disk image\n",
+		    filename);
+	    status = 1;
+	}
+    }
+
+    /* then drop the directory entries, gathering up the chains so
+       they can all be freed in one sweep over the FAT */
+    for (i = 0; i < nfiles; i++)
+    {
+	struct direntry *dirent = dirents[i];
+	if (dirent == NULL)
+	    continue;
+
+	if (lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_WRLCK) < 0)
+	    exit(1);
+	/* the same file might have been named twice */
+	if (dirent->deName[0] != SLOT_EMPTY && 
+	    dirent->deName[0] != SLOT_DELETED)
+	{
+	    collect_chain(getushort(dirent->deStartCluster),
+			  &clusters, &nclusters, &cap, image_buf, bpb);
+	    delete_dirent(dirent);
+	}
+	lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_UNLCK);
+    }
+    free_clusters(clusters, nclusters, NULL, image_buf, bpb);
+    lock_fat(fd, bpb, F_UNLCK);
+
+    free(clusters);
+    free(dirents);
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    return status;
+}
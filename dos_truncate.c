@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s <imagename> a:<filename> <size>\n", progname);
+    fprintf(stderr, "\tshrinks or extends a file in the disk image to size bytes\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    uint8_t *image_buf;
+    int fd;
+    struct bpb33* bpb;
+    struct direntry *dirent;
+    char *filename, *end;
+    unsigned long size;
+
+    if (argc != 4 || strncmp("a:", argv[2], 2) != 0)
+    {
+	usage(argv[0]);
+    }
+    filename = argv[2] + 2;
+    size = strtoul(argv[3], &end, 0);
+    if (*end != '\0' || size > UINT32_MAX)
+    {
+	usage(argv[0]);
+    }
+
+    image_buf = mmap_file(argv[1], &fd);
+    bpb = check_bootsector(image_buf);
+
+    if (lock_fat(fd, bpb, F_WRLCK) < 0)
+	exit(1);
+    dirent = find_file(filename, 0, FIND_FILE, fd, image_buf, bpb);
+    if (dirent == NULL && errno == EISDIR)
+    {
+	fprintf(stderr, "%s is a directory\n", filename);
+	exit(1);
+    }
+    if (dirent == NULL)
+    {
+	fprintf(stderr, "No file called %s exists in the disk image\n",
+		filename);
+	exit(1);
+    }
+
+    if (lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_WRLCK) < 0)
+	exit(1);
+    if (truncate_file(dirent, size, NULL, image_buf, bpb) < 0)
+    {
+	fprintf(stderr, "No more space in filesystem\n");
+	exit(1);
+    }
+    lock_dir(fd, (uint8_t*)dirent, image_buf, bpb, F_UNLCK);
+    lock_fat(fd, bpb, F_UNLCK);
+
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    return 0;
+}
@@ -7,6 +7,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <dirent.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -15,17 +19,21 @@
 #include "dos.h"
 
 
-// cluster flags
-#define CLUSTER_ZEROMASK (0)      // initial cluster flag
-#define CLUSTER_ALLMASK (255)     // full flag
-#define CLUSTER_USED (1)          // cluster is used
-#define CLUSTER_POINTED (1 << 1)  // cluster is pointed by another cluster
-#define CLUSTER_BAD (1 << 2)      // cluster is invalid
+// file anomaly flags
+#define CLUSTER_ZEROMASK (0)      // initial flag
 #define CLUSTER_DUPE (1 << 3)     // cluster points to already pointed cluster
 #define CLUSTER_DEAD (1 << 4)     // cluster points to an invalid cluster #
 #define CLUSTER_NULL (1 << 5)     // the file is empty
 #define CLUSTER_LESS (1 << 6)     // less cluster than expected
 #define CLUSTER_MORE (1 << 7)     // more cluster than expected
+#define CLUSTER_CROSS (1 << 8)    // chain runs into another chain (file only)
+
+// FAT graph flags
+#define GRAPH_HEAD (1)            // used, and no cluster points to it
+#define GRAPH_MERGE (1 << 1)      // more than one cluster points to it
+#define GRAPH_CYCLE (1 << 2)      // cluster is on a cycle of the FAT
+#define GRAPH_DEAD (1 << 3)       // chain from here ends at an invalid cluster
+#define GRAPH_LOOP (1 << 4)       // chain from here runs into a cycle
 
 /*
  * COSC 301 Project 5
@@ -34,22 +42,187 @@
  */
 struct corruption_info {
     struct direntry *file;
-    uint8_t anomaly_flag;
+    uint16_t anomaly_flag;
     struct corruption_info *next;
 };
 
+/*
+ * The FAT seen as a graph: every cluster has at most one successor, so
+ * each chain is a path that ends at EOF, at an invalid cluster, or in a
+ * cycle. Everything here is worked out in one pass before the directory
+ * walk, so tracing a file only has to look it up.
+ */
+struct fat_graph {
+    uint16_t *next;     // successor, 0 where the chain stops
+    uint16_t *indeg;    // number of clusters pointing here
+    uint16_t *length;   // distinct clusters on the chain from here
+    uint16_t *last;     // last distinct cluster on the chain from here
+    uint8_t *flags;
+};
+
+// what a record from the directory walk holds a chain of
+#define REC_NONE 0
+#define REC_FILE 1
+#define REC_DIR 2
+
+#define NO_OWNER UINT32_MAX
+
+#define MAX_THREADS 256           // most -j will start
+
+/*
+ * One record from the directory walk, in the order a serial walk
+ * prints them, along with what the chain check found for it
+ */
+struct scan_rec {
+    struct direntry *dirent;    // NULL at the start of a directory cluster
+    int depth;
+    int loop;
+    int kind;
+    uint16_t start;
+    uint32_t expected;
+    uint32_t count;
+    uint16_t anomaly_flag;
+};
+
+/*
+ * A repair plan: what the fixes change, edit by edit, so the check can
+ * run on a read-only image and the changes can be made later in one go
+ */
+#define EDIT_FAT 'f'        // one FAT entry
+#define EDIT_SIZE 's'       // the size of one file
+#define EDIT_DIRENT 'd'     // a whole directory entry
+
+struct plan_edit {
+    char kind;
+    uint8_t copy;           // EDIT_FAT: which FAT
+    uint16_t cluster;       // EDIT_FAT: which entry
+    uint32_t offset;        // EDIT_SIZE, EDIT_DIRENT: where in the image
+    uint32_t old;           // EDIT_FAT, EDIT_SIZE
+    uint32_t new;
+    uint8_t old_dirent[sizeof(struct direntry)];    // EDIT_DIRENT
+    uint8_t new_dirent[sizeof(struct direntry)];
+};
+
+struct repair_plan {
+    uint64_t image_size;
+    struct plan_edit *edits;
+    int nedits;
+    int cap;
+};
+
+/*
+ * What we know about each cluster, kept as one bitset per fact rather
+ * than a byte of flags per cluster, so a pass looking for used clusters
+ * nothing points to goes through 64 of them a word at a time.
+ */
+struct cluster_state {
+    uint32_t nclusters;
+    uint32_t nwords;
+    uint64_t *used;     // the FAT entry isn't free or bad
+    uint64_t *bad;      // the FAT entry marks a bad cluster
+    uint64_t *pointed;  // on the chain of something in the tree
+    uint64_t *dupe;     // where a file's chain was cut short
+};
+
+#define BIT_WORD(i) ((i) / 64)
+#define BIT_MASK(i) ((uint64_t)1 << ((i) % 64))
+
 struct disk_info {
     uint8_t *image_buf;
     struct bpb33 *bpb;
-    uint8_t *cluster_info;
+    struct cluster_state state;
+    struct fat_graph graph;
     struct corruption_info *corr_info;
+    int nthreads;       // threads for the directory tree and chain checks
+    struct scan_rec *recs;
+    int nrecs;
+    uint32_t *owner;    // first record, in walk order, to reach a cluster
+    FILE *out;          // where the report goes
+    int file_errors;    // files with something wrong
+    int cluster_errors; // clusters used but not pointed to, and so on
+    char *checkpoint;   // sidecar to replay or save the check, or NULL
+    int fd;             // the image file, as it was before any fixes
+    struct repair_plan *plan;   // where the fixes go, or NULL
+    uint16_t *found;    // clusters of the directory orphans went into
+    int nfound;
+    size_t mem_limit;   // most to keep for the FAT and clusters, 0 for any
+    struct window_scan *windows;    // set when that isn't enough for all
 };
 
-char toupper(char);
+void report_chain(struct scan_rec *, struct disk_info *, int);
+int validify_cluster_info(struct disk_info *);
+int report_cluster_word(struct disk_info *, uint32_t, uint64_t, uint64_t,
+                        uint64_t);
+void window_claim_chains(struct disk_info *);
+void window_check_chain(struct disk_info *, int);
+int window_validify(struct disk_info *);
+int image_is_sane(struct bpb33 *, size_t);
+uint32_t meta_sectors(struct bpb33 *);
+
+
+// How many clusters the data area has, counting the two reserved. The
+// FAT usually has entries for a few more, but they have no sectors
+// behind them, so a link to one is as dead as a link off the FAT
+uint32_t num_clusters(struct bpb33 *bpb) {
+    uint32_t meta = meta_sectors(bpb);
+    if (meta >= bpb -> bpbSectors) {
+        return 2;
+    }
+    return (bpb -> bpbSectors - meta) / bpb -> bpbSecPerClust + 2;
+}
+
+// How many entries the FAT has room for, whether or not there is a
+// cluster behind them. The repairs can touch any of them
+uint32_t fat_entries(struct bpb33 *bpb) {
+    uint32_t n = (uint32_t)bpb -> bpbFATsecs * bpb -> bpbBytesPerSec * 2 / 3;
+    return n > FAT12_MASK + 1 ? FAT12_MASK + 1 : n;
+}
+
+// is_valid_cluster() goes by the size of the image, which lets through
+// those last few entries
+int in_data_area(uint16_t cluster, struct bpb33 *bpb) {
+    return is_valid_cluster(cluster, bpb) && cluster < num_clusters(bpb);
+}
+
+static inline int bit_test(uint64_t *bits, uint32_t i) {
+    return (bits[BIT_WORD(i)] & BIT_MASK(i)) != 0;
+}
+
+static inline void bit_set(uint64_t *bits, uint32_t i) {
+    bits[BIT_WORD(i)] |= BIT_MASK(i);
+}
+
+static inline void bit_clear(uint64_t *bits, uint32_t i) {
+    bits[BIT_WORD(i)] &= ~BIT_MASK(i);
+}
+
+// For the passes where several threads mark clusters at once
+static inline void bit_set_atomic(uint64_t *bits, uint32_t i) {
+    __atomic_fetch_or(&bits[BIT_WORD(i)], BIT_MASK(i), __ATOMIC_RELAXED);
+}
+
+// All the bitsets come out of one allocation, cleared
+void alloc_cluster_state(struct cluster_state *state, uint32_t nclusters) {
+    uint32_t nwords = (nclusters + 63) / 64;
+    uint64_t *words = calloc(4 * (size_t)nwords, sizeof(uint64_t));
+
+    state -> nclusters = nclusters;
+    state -> nwords = nwords;
+    state -> used = words;
+    state -> bad = words + nwords;
+    state -> pointed = words + 2 * nwords;
+    state -> dupe = words + 3 * nwords;
+}
+
+void free_cluster_state(struct cluster_state *state) {
+    free(state -> used);
+    memset(state, 0, sizeof(*state));
+}
 
-struct corruption_info *cluster_trace(struct direntry *,
-                                      struct disk_info *,
-                                      int); 
+// The clusters 0 and 1 are reserved, so no pass looks at them
+static inline uint64_t data_clusters(uint32_t word) {
+    return word == 0 ? ~(uint64_t)3 : ~(uint64_t)0;
+}
 
 
 /*
@@ -100,112 +273,31 @@ void get_file_name(struct direntry *dirent, char *fullname) {
 }
 
 void usage(char *progname) {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [-c] [-p] [-j threads] [--mem-limit KB] <imagename>\n", progname);
+    fprintf(stderr, "       %s [-c] [-p] [-j threads] [--max-mapped MB] --fleet <list|dir>\n", progname);
+    fprintf(stderr, "       %s --apply <plan> <imagename>\n", progname);
+    fprintf(stderr, "\t-p leaves the image alone and writes the repairs to <imagename>.plan;\n");
+    fprintf(stderr, "\t--apply makes them, and saves <plan>.undo to take them back;\n");
+    fprintf(stderr, "\twithout -p the repairs are made at once, saving <imagename>.undo\n");
+    fprintf(stderr, "\t-c keeps <imagename>.scan next to the image, and replays the last\n");
+    fprintf(stderr, "\treport from it while the FATs and directories are unchanged\n");
+    fprintf(stderr, "\t--fleet checks every image named in list (one per line, - for\n");
+    fprintf(stderr, "\tstdin) or every *.img in dir, -j at a time, without fixing them,\n");
+    fprintf(stderr, "\tand prints a JSON report. It exits 1 if any image is bad.\n");
+    fprintf(stderr, "\t--mem-limit keeps the FAT and cluster state under KB, a window\n");
+    fprintf(stderr, "\tof clusters at a time with the rest in temporary files, when\n");
+    fprintf(stderr, "\tthe volume needs more. It only checks the image then.\n");
     exit(1);
 }
 
 // Prof Sommers Code
 //
 //
-/* write the values into a directory entry */
-void write_dirent(struct direntry *dirent, char *filename, 
-		  uint16_t start_cluster, uint32_t size)
-{
-    char *p, *p2;
-    char *uppername;
-    int len, i;
-
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
-
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < strlen(filename); i++) 
-    {
-	if (p2[i] == '/' || p2[i] == '\\') 
-	{
-	    uppername = p2+i+1;
-	}
-    }
-
-    /* convert filename to upper case */
-    for (i = 0; i < strlen(uppername); i++) 
-    {
-	uppername[i] = toupper(uppername[i]);
-    }
-
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL) 
-    {
-	fprintf(stderr, "No filename extension given - defaulting to .___\n");
-    }
-    else 
-    {
-	*p = '\0';
-	p++;
-	len = strlen(p);
-	if (len > 3) len = 3;
-	memcpy(dirent->deExtension, p, len);
-    }
-
-    if (strlen(uppername)>8) 
-    {
-	uppername[8]='\0';
-    }
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
-
-    /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
-    putulong(dirent->deFileSize, size);
-
-    /* could also set time and date here if we really
-       cared... */
-}
-
-
-/* create_dirent finds a free slot in the directory, and write the
-   directory entry */
-
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
-{
-    while (1) 
-    {
-	if (dirent->deName[0] == SLOT_EMPTY) 
-	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
-
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    return;
-	}
-
-	if (dirent->deName[0] == SLOT_DELETED) 
-	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    return;
-	}
-	dirent++;
-    }
-}
-
-void print_indent(int indent)
+void print_indent(FILE *out, int indent)
 {
     int i;
     for (i = 0; i < indent*4; i++)
-	printf(" ");
+	fprintf(out, " ");
 }
 
 /*
@@ -214,10 +306,8 @@ void print_indent(int indent)
 
 
 uint16_t print_dirent(struct direntry *dirent, int indent,
-                      uint16_t cluster, struct disk_info *disk_info) {
-    uint8_t *cluster_info = disk_info -> cluster_info; 
-    struct bpb33 *bpb = disk_info -> bpb;
-
+                      struct scan_rec *rec, struct disk_info *disk_info) {
+    FILE *out = disk_info -> out;
     uint16_t followclust = 0;
 
     int i;
@@ -263,21 +353,17 @@ uint16_t print_dirent(struct direntry *dirent, int indent,
     if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN) {
 	// ignore any long file name extension entries
 	//
-	// printf("Win95 long-filename entry seq 0x%0x\n", dirent->deName[0]);
+	// fprintf(out, "Win95 long-filename entry seq 0x%0x\n", dirent->deName[0]);
     } else if ((dirent->deAttributes & ATTR_VOLUME) != 0)  {
-	printf("Volume: %s\n", name);
+	fprintf(out, "Volume: %s\n", name);
     } else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
         // don't deal with hidden directories; MacOS makes these
         // for trash directories and such; just ignore them.
 	    if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN) {
-	        print_indent(indent);
-    	    printf("%s/ (directory)\n", name);
+	        print_indent(out, indent);
+    	    fprintf(out, "%s/ (directory)\n", name);
             file_cluster = getushort(dirent->deStartCluster);
             followclust = file_cluster;
-
-            // Change cluster_info to mark file_cluster as being pointed to
-            // We assume the directory only takes one cluster
-            cluster_info[file_cluster] |= CLUSTER_POINTED;
         }
     } else {
         /*
@@ -286,193 +372,445 @@ uint16_t print_dirent(struct direntry *dirent, int indent,
          */
 
         size = getulong(dirent->deFileSize);
-        print_indent(indent);
-        printf("%s.%s (%u bytes) (starting cluster %d)\n", 
+        print_indent(out, indent);
+        fprintf(out, "%s.%s (%u bytes) (starting cluster %d)\n", 
            name, extension, size, getushort(dirent->deStartCluster));
        
-
-        
-
-   
-        // Go through the FAT chain of the file and mark cluster as being
-        // pointer to. Done through the cluster_trace function
-        cluster_trace(dirent, disk_info, indent+1);
+        // What the chain check found for the file
+        report_chain(rec, disk_info, indent+1);
 
     }
 
     return followclust;
 }
 
-void follow_dir(uint16_t cluster, int indent, struct disk_info *disk_info) {
-    uint8_t *image_buf = disk_info -> image_buf; 
-    struct bpb33* bpb = disk_info -> bpb;
+// Which kind of chain a dirent owns, going by the same rules
+// print_dirent uses to decide what to print
+int rec_kind(struct direntry *dirent) {
+    uint8_t first = dirent->deName[0];
 
-    while (is_valid_cluster(cluster, bpb)) {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-        
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        printf("Number of dir entries are: %d \n", numDirEntries);
-        for (int i = 0 ; i < numDirEntries; i++) {
-            uint16_t followclust = print_dirent(dirent, indent, cluster, disk_info);
-            if (followclust) {
-                follow_dir(followclust, indent+1, disk_info);
-            }
-            dirent++;
+    if (first == SLOT_EMPTY || first == SLOT_DELETED || first == 0x2E) {
+        return REC_NONE;
+    }
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN ||
+        (dirent->deAttributes & ATTR_VOLUME) != 0) {
+        return REC_NONE;
+    }
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) {
+        if ((dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN) {
+            return REC_NONE;
         }
-
-	cluster = get_fat_entry(cluster, image_buf, bpb);
+        return REC_DIR;
     }
+    return REC_FILE;
 }
 
-// End of Prof Sommers code
-
+// Walk the whole tree with the directory iterator. It doesn't recurse,
+// and won't go round a directory that points back at one of its
+// ancestors. The records are kept in walk order, to be checked and
+// printed once the FAT graph is ready.
 void traverse_dirent(struct disk_info *disk_info) {
     uint8_t *image_buf = disk_info -> image_buf; 
     struct bpb33 *bpb = disk_info -> bpb; 
+    struct dir_iter it;
+    struct dir_rec rec;
+    int cap = 64;
+
+    disk_info -> recs = malloc(cap * sizeof(struct scan_rec));
+    disk_info -> nrecs = 0;
+
+    // we hold the whole image already, so no locking as we go
+    dir_iter_init_parallel(&it, DIR_ITER_CLUSTERS, disk_info -> nthreads,
+                           -1, image_buf, bpb);
+    while (dir_iter_next(&it, &rec)) {
+        if (disk_info -> nrecs == cap) {
+            cap *= 2;
+            disk_info -> recs = realloc(disk_info -> recs,
+                                        cap * sizeof(struct scan_rec));
+        }
+        struct scan_rec *r = &disk_info -> recs[disk_info -> nrecs++];
+        memset(r, 0, sizeof(struct scan_rec));
+        r -> dirent = rec.dirent;
+        r -> depth = rec.depth;
+        r -> loop = rec.loop;
+        if (rec.dirent != NULL) {
+            r -> kind = rec_kind(rec.dirent);
+            r -> start = getushort(rec.dirent->deStartCluster);
+        }
+    }
+    dir_iter_finish(&it);
+}
 
-    struct direntry *dirent = (struct direntry *)  root_dir_addr(image_buf, bpb);
-    for (int i = 0; i < bpb -> bpbRootDirEnts; i++) {
-        // 19 is the cluster number of the root dir
-        uint16_t followclust = print_dirent(dirent, 0, 19, disk_info);
-        if (is_valid_cluster(followclust, bpb)) {
-            follow_dir(followclust, 1, disk_info);
+// Print the records the way the walk found them
+void print_records(struct disk_info *disk_info) {
+    struct bpb33 *bpb = disk_info -> bpb; 
+    FILE *out = disk_info -> out;
+
+    for (int i = 0; i < disk_info -> nrecs; i++) {
+        struct scan_rec *rec = &disk_info -> recs[i];
+        if (rec -> dirent == NULL) {
+            fprintf(out, "Number of dir entries are: %d \n",
+                   (int)((bpb->bpbBytesPerSec * bpb->bpbSecPerClust) /
+                         sizeof(struct direntry)));
+            continue;
+        }
+        print_dirent(rec -> dirent, rec -> depth, rec, disk_info);
+        if (rec -> loop) {
+            print_indent(out, rec -> depth + 1);
+            fprintf(out, "** Warning: directory loops back on itself, not following it **\n");
         }
-        dirent++;
     }
 }
 
 /*
  * Prints error based on detected cluster anomaly
  */
-void print_anomaly_error(uint8_t anomaly_flag, int indent) {
+void print_anomaly_error(FILE *out, uint16_t anomaly_flag, int indent) {
     if ( anomaly_flag & CLUSTER_NULL ) {
-        print_indent(indent);
-        printf("** Warning: The file is empty **\n");
+        print_indent(out, indent);
+        fprintf(out, "** Warning: The file is empty **\n");
     }
     if ( anomaly_flag & CLUSTER_LESS ) {
-        print_indent(indent);
-        printf("** Warning: Less data exists than expected **\n");
+        print_indent(out, indent);
+        fprintf(out, "** Warning: Less data exists than expected **\n");
     }
     if ( anomaly_flag & CLUSTER_MORE ) {
-        print_indent(indent);
-        printf("** Warning: More data exists than expected **\n");
+        print_indent(out, indent);
+        fprintf(out, "** Warning: More data exists than expected **\n");
     }
     if ( anomaly_flag & CLUSTER_DEAD ) {
-        print_indent(indent);
-        printf("** Invalid cluster end found: pointing to nonexistent cluster **\n");
+        print_indent(out, indent);
+        fprintf(out, "** Invalid cluster end found: pointing to nonexistent cluster **\n");
     }
     if ( anomaly_flag & CLUSTER_DUPE ) {
-        print_indent(indent);
-        printf("** Invalid cluster end found: duplicated pointing to cluster **\n");
+        print_indent(out, indent);
+        fprintf(out, "** Invalid cluster end found: duplicated pointing to cluster **\n");
     } 
+    if ( anomaly_flag & CLUSTER_CROSS ) {
+        print_indent(out, indent);
+        fprintf(out, "** Invalid cluster end found: cross-linked with another chain **\n");
+    }
 }
 
-// Trace the FAT chain starting from start_cluster
-// Mark the corresponding index in cluster_info as being pointed to
-// Return the total number of cluster in the chain
-struct corruption_info *cluster_trace(struct direntry *dirent,
-                                      struct disk_info *disk_info,
-                                      int indent) {
-    uint8_t *image_buf = disk_info -> image_buf;
-    uint8_t *cluster_info = disk_info -> cluster_info;
+/*
+ * Claim the chain of record i: every cluster on it belongs to the first
+ * record in walk order that reaches it, which is what a serial walk that
+ * stops at already pointed clusters would find. Threads may get here in
+ * any order, so the owner only ever goes down, and we stop where a record
+ * at or before us has been through already.
+ */
+void claim_chain(struct disk_info *disk_info, int i) {
+    struct scan_rec *rec = &disk_info -> recs[i];
+    uint32_t *owner = disk_info -> owner;
+    uint16_t cluster = rec -> start;
+
+    if (rec -> kind == REC_NONE ||
+        !in_data_area(cluster, disk_info -> bpb)) {
+        return;
+    }
+    while (cluster != 0) {
+        uint32_t old = __atomic_load_n(&owner[cluster], __ATOMIC_RELAXED);
+        while (old > (uint32_t)i &&
+               !__atomic_compare_exchange_n(&owner[cluster], &old, i, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED)) {
+        }
+        bit_set_atomic(disk_info -> state.pointed, cluster);
+        if (old <= (uint32_t)i) {
+            break;
+        }
+        cluster = disk_info -> graph.next[cluster];
+    }
+}
+
+// Check the chain of file record i once every chain has been claimed.
+// How the chain ends comes from the FAT graph; the clusters the file
+// counts are those it owns, so it stops where it runs into an earlier
+// chain or comes back round on itself
+void check_chain(struct disk_info *disk_info, int i) {
+    struct scan_rec *rec = &disk_info -> recs[i];
+    struct fat_graph *graph = &disk_info -> graph;
     struct bpb33 *bpb = disk_info -> bpb;
-    
-    uint32_t size = getulong(dirent->deFileSize);
+
+    if (rec -> kind != REC_FILE) {
+        return;
+    }
+
+    uint32_t size = getulong(rec -> dirent->deFileSize);
     uint16_t sectorSize = bpb -> bpbBytesPerSec;
     uint32_t num_of_cluster = (size + sectorSize - 1) / sectorSize;
 
-    uint8_t anomaly_flag = CLUSTER_ZEROMASK;
+    uint16_t anomaly_flag = CLUSTER_ZEROMASK;
     
-    uint16_t cluster = getushort(dirent->deStartCluster);
+    uint16_t cluster = rec -> start;
     uint32_t cluster_count = 0;
+    int cut = 0;        // the chain stops short at cluster
 
 
     if (cluster == 0) {
         // The file is empty
         anomaly_flag |= CLUSTER_NULL;
-    } else do {
-        cluster_count ++;
-
-        cluster_info[cluster] |= CLUSTER_POINTED;
-        uint16_t next_cluster = get_fat_entry(cluster, image_buf, bpb);
-
-        // Check and mark pointer flag
-        if (num_of_cluster > cluster_count && is_end_of_file(next_cluster)) {
-            // The file shouldn't end here
-            cluster_info[cluster] |= CLUSTER_LESS;
-            anomaly_flag |= CLUSTER_LESS;
-            break;
-        }
-        if (!is_end_of_file(next_cluster)) {
-            if (!is_valid_cluster(next_cluster, bpb))  {
-                // Points to invalid cluster
-                cluster_info[cluster] |= CLUSTER_DEAD;
-                anomaly_flag |= CLUSTER_DEAD;
+    } else if (!in_data_area(cluster, bpb)) {
+        // Starts at an invalid cluster, or past the end of the disk
+        anomaly_flag |= CLUSTER_DEAD;
+    } else {
+        uint16_t end = graph -> last[cluster];
+        uint16_t next_cluster = 0;
+        while (1) {
+            cluster_count ++;
+            next_cluster = graph -> next[cluster];
+            if (cluster == end || disk_info -> owner[next_cluster] != (uint32_t)i) {
                 break;
             }
-            /* The previous logic suddenly stopped working because
-             * it did not stop at the end of the file, and thus
-             * the end of the file cluster (filled with garbage)
-             * resulted in GIGO situation with anomaly_flag
-             */
-            if ( (cluster_info[next_cluster] & CLUSTER_POINTED ) ) {
-                // Points to a previously pointed cluster
-                cluster_info[cluster] |= CLUSTER_DUPE;
+            cluster = next_cluster;
+        }
+
+        if (cluster != end) {
+            // Runs into a chain we have been down before. If that is a
+            // cycle this file loops too, otherwise it is cross-linked
+            cut = 1;
+            if (graph -> flags[next_cluster] & GRAPH_CYCLE) {
                 anomaly_flag |= CLUSTER_DUPE;
-                break;
+            } else {
+                anomaly_flag |= CLUSTER_CROSS;
             }
+        } else if (graph -> flags[cluster] & GRAPH_LOOP) {
+            // Comes back round on itself
+            cut = 1;
+            anomaly_flag |= CLUSTER_DUPE;
+        } else if (graph -> flags[cluster] & GRAPH_DEAD) {
+            // Points to invalid cluster
+            anomaly_flag |= CLUSTER_DEAD;
+        } else if (num_of_cluster > cluster_count) {
+            // The file shouldn't end here
+            anomaly_flag |= CLUSTER_LESS;
         }
-        cluster = next_cluster;
-    } while ((!is_end_of_file(cluster)));
+        // another file may be marking a cluster in the same word
+        if (cut) {
+            bit_set_atomic(disk_info -> state.dupe, cluster);
+        }
+    }
 
     if (num_of_cluster < cluster_count) {
         anomaly_flag |= CLUSTER_MORE;
     }
 
-    print_indent(indent);
-    printf("Expected sectors occupied based on size: %d \n", num_of_cluster);
-    print_indent(indent);
-    printf("Actual number of clusters occupied is: %d\n", cluster_count);
+    rec -> expected = num_of_cluster;
+    rec -> count = cluster_count;
+    rec -> anomaly_flag = anomaly_flag;
+}
+
+// Print what check_chain found for a file, and queue it for fixing
+void report_chain(struct scan_rec *rec, struct disk_info *disk_info,
+                  int indent) {
+    FILE *out = disk_info -> out;
 
-    print_anomaly_error(anomaly_flag, indent);
+    print_indent(out, indent);
+    fprintf(out, "Expected sectors occupied based on size: %d \n", rec -> expected);
+    print_indent(out, indent);
+    fprintf(out, "Actual number of clusters occupied is: %d\n", rec -> count);
 
-    struct corruption_info *new_info = NULL;
-    if ((anomaly_flag & (CLUSTER_ALLMASK ^ CLUSTER_NULL)) != CLUSTER_ZEROMASK) {
-        new_info = malloc(sizeof(struct corruption_info));
-        new_info -> file = dirent;
+    print_anomaly_error(out, rec -> anomaly_flag, indent);
+
+    if ((rec -> anomaly_flag & ~CLUSTER_NULL) != CLUSTER_ZEROMASK) {
+        struct corruption_info *new_info = malloc(sizeof(struct corruption_info));
+        new_info -> file = rec -> dirent;
         new_info -> next = NULL;
-        new_info -> anomaly_flag = anomaly_flag;
+        new_info -> anomaly_flag = rec -> anomaly_flag;
         add_corr_entry(disk_info, new_info);
     }
-    return new_info;
 }
 
-void check_free_cluster(struct disk_info *disk_info) {
-    uint8_t *cluster_info = disk_info -> cluster_info;
+struct scan_pool {
+    struct disk_info *disk_info;
+    void (*job)(struct disk_info *, int);
+    int next;           // next record to hand out
+};
+
+void *scan_worker(void *arg) {
+    struct scan_pool *pool = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&pool -> next, 1, __ATOMIC_RELAXED)) <
+           pool -> disk_info -> nrecs) {
+        pool -> job(pool -> disk_info, i);
+    }
+    return NULL;
+}
+
+// Run job over every record, on nthreads threads counting this one.
+// Threads that won't start just leave more of the records to the rest,
+// and this one always takes part, so the job gets done regardless
+void run_pool(struct disk_info *disk_info,
+              void (*job)(struct disk_info *, int)) {
+    struct scan_pool pool = { disk_info, job, 0 };
+    int nthreads = disk_info -> nthreads, started = 0;
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+
+    while (started < nthreads - 1 &&
+           pthread_create(&threads[started], NULL, scan_worker, &pool) == 0) {
+        started ++;
+    }
+    scan_worker(&pool);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// Every chain has to be claimed before any file can be checked
+void check_chains(struct disk_info *disk_info) {
+    int size = disk_info -> state.nclusters;
+
+    disk_info -> owner = malloc(size * sizeof(uint32_t));
+    for (int i = 0; i < size; i++) {
+        disk_info -> owner[i] = NO_OWNER;
+    }
+    run_pool(disk_info, claim_chain);
+    run_pool(disk_info, check_chain);
+}
+
+/*
+ * One pass over the FAT before anything else looks at it. Marks used and
+ * bad clusters, counts how many clusters point at each one, and works out
+ * for every cluster how long its chain is and how that chain ends. Each
+ * cluster goes on the path once and is resolved once, so this is linear.
+ */
+void build_fat_graph(struct disk_info *disk_info) {
+    struct cluster_state *cstate = &disk_info -> state;
     uint8_t *image_buf = disk_info -> image_buf;
     struct bpb33 *bpb = disk_info -> bpb;
-    // Assumes cluster_info is clean and pristine
-    uint16_t cluster = 0;
-    for (int i = 2; i < bpb -> bpbSectors; i++) {
-        cluster = get_fat_entry(i, image_buf, bpb);
+    struct fat_graph *graph = &disk_info -> graph;
+    int size = cstate -> nclusters;
+
+    graph -> next = calloc(size, sizeof(uint16_t));
+    graph -> indeg = calloc(size, sizeof(uint16_t));
+    graph -> length = calloc(size, sizeof(uint16_t));
+    graph -> last = calloc(size, sizeof(uint16_t));
+    graph -> flags = calloc(size, sizeof(uint8_t));
+    uint16_t *path = malloc(size * sizeof(uint16_t));
+    uint8_t *state = calloc(size, sizeof(uint8_t));  // 1 on path, 2 done
+
+    // Assumes the cluster state is clean and pristine
+    for (int i = 2; i < size; i++) {
+        uint16_t cluster = get_fat_entry(i, image_buf, bpb);
         if (cluster == (FAT12_MASK & CLUST_BAD)) {
-            cluster_info[i] |= CLUSTER_BAD;
+            bit_set(cstate -> bad, i);
         } else if (cluster != CLUST_FREE) {
         // Check for free cluster            
-            (cluster_info[i]) |= CLUSTER_USED;
+            bit_set(cstate -> used, i);
+        }
+        if (is_valid_cluster(cluster, bpb) && cluster < size) {
+            graph -> next[i] = cluster;
+            graph -> indeg[cluster] ++;
+        } else if (!is_end_of_file(cluster)) {
+            graph -> flags[i] |= GRAPH_DEAD;
+        }
+    }
+
+    for (int i = 2; i < size; i++) {
+        if (bit_test(cstate -> used, i) && graph -> indeg[i] == 0) {
+            graph -> flags[i] |= GRAPH_HEAD;
+        }
+        if (graph -> indeg[i] > 1) {
+            graph -> flags[i] |= GRAPH_MERGE;
+        }
+        if (state[i] != 0) {
+            continue;
+        }
+
+        // Follow the chain until it stops, comes back round on itself
+        // or joins one that is already done
+        int depth = 0;
+        uint16_t cluster = i;
+        while (state[cluster] == 0) {
+            state[cluster] = 1;
+            path[depth++] = cluster;
+            if (graph -> next[cluster] == 0) {
+                break;
+            }
+            cluster = graph -> next[cluster];
+        }
+
+        if (graph -> next[path[depth - 1]] != 0 && state[cluster] == 1) {
+            // The end of the path is a cycle
+            int start = depth - 1;
+            while (path[start] != cluster) {
+                start--;
+            }
+            for (int k = start; k < depth; k++) {
+                uint16_t c = path[k];
+                graph -> flags[c] |= GRAPH_CYCLE | GRAPH_LOOP;
+                graph -> length[c] = depth - start;
+                graph -> last[c] = path[k == start ? depth - 1 : k - 1];
+                state[c] = 2;
+            }
+            depth = start;
+        }
+
+        // The rest of the path takes after its successor
+        while (depth > 0) {
+            uint16_t c = path[--depth];
+            uint16_t next = graph -> next[c];
+            if (next == 0) {
+                graph -> length[c] = 1;
+                graph -> last[c] = c;
+            } else {
+                graph -> length[c] = graph -> length[next] + 1;
+                graph -> last[c] = graph -> last[next];
+                graph -> flags[c] |= graph -> flags[next] & (GRAPH_DEAD | GRAPH_LOOP);
+            }
+            state[c] = 2;
         }
     }
+
+    free(path);
+    free(state);
+}
+
+void *fat_graph_thread(void *arg) {
+    build_fat_graph(arg);
+    return NULL;
+}
+
+void free_fat_graph(struct fat_graph *graph) {
+    free(graph -> next);
+    free(graph -> indeg);
+    free(graph -> length);
+    free(graph -> last);
+    free(graph -> flags);
 }
 
 
 int data_is_inconsistent(struct disk_info *disk_info) {
-    struct bpb33 *bpb = disk_info -> bpb;
-    uint8_t *cluster_info = disk_info -> cluster_info;
+    FILE *out = disk_info -> out;
     int has_error = 0;
      
-    check_free_cluster(disk_info); 
-    traverse_dirent(disk_info);
-    has_error = validify_cluster_info(cluster_info, bpb);
+    if (disk_info -> windows != NULL) {
+        // A window of the FAT at a time, see window_scan below
+        traverse_dirent(disk_info);
+        window_claim_chains(disk_info);
+        for (int i = 0; i < disk_info -> nrecs; i++) {
+            window_check_chain(disk_info, i);
+        }
+        print_records(disk_info);
+        has_error = window_validify(disk_info);
+    } else {
+        // The FAT pass and the directory walk don't touch each other's
+        // data, so with threads to spare they run side by side
+        pthread_t graph_thread;
+        int side = disk_info -> nthreads > 1 &&
+            pthread_create(&graph_thread, NULL, fat_graph_thread, disk_info) == 0;
+        if (!side) {
+            build_fat_graph(disk_info); 
+        }
+        traverse_dirent(disk_info);
+        if (side) {
+            pthread_join(graph_thread, NULL);
+        }
+        check_chains(disk_info);
+        print_records(disk_info);
+        has_error = validify_cluster_info(disk_info);
+    }
 
     char fullname[15];
     // Print files error
@@ -482,56 +820,260 @@ int data_is_inconsistent(struct disk_info *disk_info) {
     }
     while (info != NULL) {
         get_file_name(info -> file, fullname);
-        printf("File inconsistency: %s \n", fullname);
+        fprintf(out, "File inconsistency: %s \n", fullname);
+        disk_info -> file_errors ++;
         info = info -> next;
     }
 
-    printf("==========\n");
-    printf("End of error messages\n");
+    fprintf(out, "==========\n");
+    fprintf(out, "End of error messages\n");
 
     return has_error;
 }
 
 
 /*
- * Check consistency between "pointed" and "used" flag
+ * Check consistency between "pointed" and "used" flag. Goes a word of
+ * clusters at a time, and only stops at the bits that need a message
  */
-int validify_cluster_info(uint8_t *cluster_info, struct bpb33 *bpb) {
+int validify_cluster_info(struct disk_info *disk_info) {
+    struct cluster_state *state = &disk_info -> state;
     int has_error = 0;
-    int size = bpb -> bpbSectors;
-    for (int i = 2; i < size; i++) {
-        uint8_t value = cluster_info[i];
-        if (value & CLUSTER_POINTED) {
-            if (value & CLUSTER_BAD) {
-                printf("Cluster %d is pointed to but is a bad cluster\n", i);
-                has_error = 1;
-            } else if (!(value & CLUSTER_USED)) {
-                printf("Cluster %d is free but pointed to.\n", i);
-                has_error = 1;
+    for (uint32_t w = 0; w < state -> nwords; w++) {
+        has_error |= report_cluster_word(disk_info, w, state -> used[w],
+                                         state -> bad[w], state -> pointed[w]);
+    }
+    return has_error;
+}
+
+// Report the clusters in word w of the bitsets that don't add up
+int report_cluster_word(struct disk_info *disk_info, uint32_t w,
+                        uint64_t used, uint64_t bad, uint64_t pointed) {
+    FILE *out = disk_info -> out;
+    uint64_t odd = (pointed & (bad | ~used)) | (used & ~bad & ~pointed);
+    int has_error = 0;
+
+    odd &= data_clusters(w);
+    while (odd != 0) {
+        uint64_t bit = odd & -odd;
+        int i = w * 64 + __builtin_ctzll(odd);
+        odd ^= bit;
+        if (!(pointed & bit)) {
+            fprintf(out, "Cluster %d is used but not pointed to.\n", i);
+        } else if (bad & bit) {
+            fprintf(out, "Cluster %d is pointed to but is a bad cluster\n", i);
+        } else {
+            fprintf(out, "Cluster %d is free but pointed to.\n", i);
+        }
+        has_error = 1;
+        disk_info -> cluster_errors ++;
+    }
+    return has_error;
+}
+
+void print_diag_message(FILE *out, char *filename, char *error, char *fix) {
+        fprintf(out, "Fixing %s : \n", filename);
+        print_indent(out, 1);
+        fprintf(out, "%s\n", error);
+        print_indent(out, 1);
+        fprintf(out, "%s", fix);
+}
+
+/*
+ * Orphans are clusters in use that no chain in the tree reaches. Each
+ * orphan chain is saved whole, from its head (the orphan no other orphan
+ * points to), as one FILEnnnn.CHK the size of the chain, the way CHKDSK
+ * does it. The files all go in a new FOUNDnnn directory in the root,
+ * made in one go: its clusters are taken together and filled in, and it
+ * goes into the root last, so a full disk or root leaves things as they
+ * were.
+ */
+
+#define MAX_FOUND 10000     // FILE0000.CHK to FILE9999.CHK
+#define MAX_FOUND_DIRS 1000 // FOUND000 to FOUND999
+
+struct orphan_chain {
+    uint16_t head;
+    uint16_t tail;      // where the chain gets cut, if it has to be
+    uint32_t count;
+};
+
+// Take the chain from head off the orphans. It stops where it runs into
+// a cluster that isn't an orphan left, or comes back round on itself
+void take_orphan_chain(struct disk_info *disk_info, uint64_t *orphans,
+                       uint16_t head, struct orphan_chain *chain) {
+    uint8_t *image_buf = disk_info -> image_buf;
+    struct bpb33 *bpb = disk_info -> bpb;
+    uint16_t cluster = head;
+
+    chain -> head = head;
+    chain -> count = 0;
+    while (1) {
+        bit_clear(orphans, cluster);
+        chain -> count ++;
+        uint16_t next = get_fat_entry(cluster, image_buf, bpb);
+        if (!in_data_area(next, bpb) || !bit_test(orphans, next)) {
+            break;
+        }
+        cluster = next;
+    }
+    chain -> tail = cluster;
+}
+
+// Find a FOUNDnnn the root doesn't have yet, and a slot for it
+struct direntry *found_dir_slot(uint8_t *image_buf, struct bpb33 *bpb,
+                                int *number) {
+    struct direntry *root = (struct direntry *) root_dir_addr(image_buf, bpb);
+    struct direntry *slot = NULL;
+    uint8_t taken[MAX_FOUND_DIRS];
+
+    memset(taken, 0, sizeof(taken));
+    for (int i = 0; i < bpb -> bpbRootDirEnts; i++) {
+        struct direntry *dirent = &root[i];
+        if (dirent->deName[0] == SLOT_EMPTY) {
+            if (slot == NULL) {
+                slot = dirent;
+            }
+            break;
+        }
+        if ((uint8_t)dirent->deName[0] == SLOT_DELETED) {
+            if (slot == NULL) {
+                slot = dirent;
             }
+            continue;
         }
-        if ((value & CLUSTER_USED) &&
-            (!(value & CLUSTER_BAD)) &&
-            (!(value & CLUSTER_POINTED))) {
-            printf("Cluster %d is used but not pointed to.\n", i);
-            has_error = 1;
+        if (memcmp(dirent->deName, "FOUND", 5) == 0) {
+            int n = 0;
+            for (int k = 5; k < 8 && n >= 0; k++) {
+                char c = dirent->deName[k];
+                n = c >= '0' && c <= '9' ? n * 10 + c - '0' : -1;
+            }
+            if (n >= 0) {
+                taken[n] = 1;
+            }
         }
     }
-    return has_error;
+    for (*number = 0; *number < MAX_FOUND_DIRS && taken[*number]; (*number)++) {
+    }
+    return *number < MAX_FOUND_DIRS ? slot : NULL;
 }
 
-void print_diag_message(char *filename, char *error, char *fix) {
-        printf("Fixing %s : \n", filename);
-        print_indent(1);
-        printf("%s\n", error);
-        print_indent(1);
-        printf("%s", fix);
+void recover_orphans(struct disk_info *disk_info) {
+    FILE *out = disk_info -> out;
+    uint8_t *image_buf = disk_info -> image_buf;
+    struct bpb33 *bpb = disk_info -> bpb;
+    struct cluster_state *state = &disk_info -> state;
+    uint32_t cluster_size = bpb -> bpbBytesPerSec * bpb -> bpbSecPerClust;
+    uint64_t *orphans = calloc(state -> nwords, sizeof(uint64_t));
+    uint64_t *inner = calloc(state -> nwords, sizeof(uint64_t));
+    struct orphan_chain *chains = NULL;
+    int nchains = 0, cap = 0;
+
+    for (uint32_t w = 0; w < state -> nwords; w++) {
+        uint64_t bits = state -> used[w] & ~state -> pointed[w] & data_clusters(w);
+        for ( ; bits != 0; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            if (get_fat_entry(i, image_buf, bpb) != (FAT12_MASK & CLUST_BAD)) {
+                bit_set(orphans, i);
+            }
+        }
+    }
+    // Orphans with an orphan pointing at them are inside a chain
+    for (uint32_t w = 0; w < state -> nwords; w++) {
+        for (uint64_t bits = orphans[w]; bits != 0; bits &= bits - 1) {
+            uint16_t next = get_fat_entry(w * 64 + __builtin_ctzll(bits),
+                                          image_buf, bpb);
+            if (in_data_area(next, bpb) && bit_test(orphans, next)) {
+                bit_set(inner, next);
+            }
+        }
+    }
+
+    // The heads first, then what is left, which can only be cycles
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t w = 0; w < state -> nwords && nchains < MAX_FOUND; w++) {
+            uint64_t bits;
+            while (nchains < MAX_FOUND &&
+                   (bits = orphans[w] & (pass == 0 ? ~inner[w] : ~(uint64_t)0)) != 0) {
+                if (nchains == cap) {
+                    cap = cap == 0 ? 16 : cap * 2;
+                    chains = realloc(chains, cap * sizeof(struct orphan_chain));
+                }
+                take_orphan_chain(disk_info, orphans, w * 64 + __builtin_ctzll(bits),
+                                  &chains[nchains++]);
+            }
+        }
+    }
+    free(orphans);
+    free(inner);
+    if (nchains == 0) {
+        free(chains);
+        return;
+    }
+
+    // Room for ".", ".." and a file for each chain
+    uint32_t per_cluster = cluster_size / sizeof(struct direntry);
+    int ndir = (nchains + 2 + per_cluster - 1) / per_cluster;
+    uint16_t *dir = malloc(ndir * sizeof(uint16_t));
+    int number, got = 0;
+    struct direntry *slot = found_dir_slot(image_buf, bpb, &number);
+    for (uint32_t i = 2; i < state -> nclusters && got < ndir && slot != NULL; i++) {
+        if (get_fat_entry(i, image_buf, bpb) == CLUST_FREE) {
+            dir[got++] = i;
+        }
+    }
+    if (slot == NULL || got < ndir) {
+        fprintf(out, "Cannot save %d orphaned chains: %s\n", nchains,
+                slot == NULL ? "root directory is full" : "disk is full");
+        free(dir);
+        free(chains);
+        return;
+    }
+
+    char dirname[16], filename[24];
+    sprintf(dirname, "FOUND%03d", number);
+    for (int i = 0; i < ndir; i++) {
+        memset(cluster_to_addr(dir[i], image_buf, bpb), 0, cluster_size);
+        set_fat_entry(dir[i], i + 1 < ndir ? dir[i + 1] : CLUST_EOFS & FAT12_MASK,
+                      image_buf, bpb);
+    }
+    for (int k = 0; k < nchains + 2; k++) {
+        struct direntry *dirent = (struct direntry *)
+            cluster_to_addr(dir[k / per_cluster], image_buf, bpb) + k % per_cluster;
+        if (k < 2) {
+            write_dir_dirent(dirent, k == 0 ? "." : "..", k == 0 ? dir[0] : MSDOSFSROOT);
+            continue;
+        }
+        struct orphan_chain *chain = &chains[k - 2];
+        sprintf(filename, "FILE%04d.CHK", k - 2);
+        fprintf(out, "Fixing cluster %d: saving orphaned chain of %u clusters\n",
+                chain -> head, chain -> count);
+        print_indent(out, 1);
+        fprintf(out, "File name is: %s/%s\n", dirname, filename);
+        write_dirent(dirent, filename, chain -> head, chain -> count * cluster_size);
+        if (!is_end_of_file(get_fat_entry(chain -> tail, image_buf, bpb))) {
+            set_fat_entry(chain -> tail, CLUST_EOFS & FAT12_MASK, image_buf, bpb);
+        }
+    }
+
+    // and only now does it show up in the root
+    struct direntry *root = (struct direntry *) root_dir_addr(image_buf, bpb);
+    if (slot->deName[0] == SLOT_EMPTY && slot + 1 < root + bpb -> bpbRootDirEnts) {
+        // the end of the root moves up one
+        memset(slot + 1, 0, sizeof(struct direntry));
+    }
+    write_dir_dirent(slot, dirname, dir[0]);
+
+    disk_info -> found = dir;
+    disk_info -> nfound = ndir;
+    free(chains);
 }
 
 void fix_corruption(struct disk_info *disk_info) {
+    FILE *out = disk_info -> out;
     uint8_t *image_buf = disk_info -> image_buf;
     struct bpb33 *bpb = disk_info -> bpb;
-    uint8_t *cluster_info = disk_info -> cluster_info;
+    struct cluster_state *state = &disk_info -> state;
     uint16_t clusterSize = bpb -> bpbBytesPerSec * bpb -> bpbSecPerClust ;
     struct corruption_info *info = disk_info -> corr_info;
     
@@ -550,7 +1092,7 @@ void fix_corruption(struct disk_info *disk_info) {
 
         // More cluster in FAT chain than file size
         if ((info -> anomaly_flag) & CLUSTER_MORE) {
-            print_diag_message(fullname,
+            print_diag_message(out, fullname,
                     "more cluster in FAT chain than the file size indicates.",
                     "Trimming cluster chain... ");
             
@@ -568,23 +1110,27 @@ void fix_corruption(struct disk_info *disk_info) {
                     break;
                 }
                 next_cluster = get_fat_entry(cluster, image_buf, bpb);
-                cluster_info[cluster] &= CLUSTER_ALLMASK ^ CLUSTER_POINTED;
-                cluster_info[cluster] &= CLUSTER_ALLMASK ^ CLUSTER_USED;
+                if (cluster < state -> nclusters) {
+                    bit_clear(state -> pointed, cluster);
+                    bit_clear(state -> used, cluster);
+                }
                 set_fat_entry(cluster, CLUST_FREE & FAT12_MASK, image_buf, bpb);
                 cluster = next_cluster;
             } 
             if (cluster != (CLUST_BAD & FAT12_MASK)) {
-                cluster_info[cluster] &= CLUSTER_ALLMASK ^ CLUSTER_POINTED;
-                cluster_info[cluster] &= CLUSTER_ALLMASK ^ CLUSTER_USED;
+                if (cluster < state -> nclusters) {
+                    bit_clear(state -> pointed, cluster);
+                    bit_clear(state -> used, cluster);
+                }
                 set_fat_entry(cluster, CLUST_FREE & FAT12_MASK, image_buf, bpb);
             }
-            printf("Done\n");
+            fprintf(out, "Done\n");
         }
 
         // Less cluster in FAT chain than file size
         // We change the file size to match the FAT chain
         if ((info -> anomaly_flag) & CLUSTER_LESS) {
-            print_diag_message(fullname,
+            print_diag_message(out, fullname,
                     "less cluster in FAT chain than file size indicate.",
                     "Adjusting size... ");
             
@@ -597,7 +1143,7 @@ void fix_corruption(struct disk_info *disk_info) {
             size = cluster_count * clusterSize;
             //printf("Cluster count is :%d\n", cluster_count);
             putulong(dirent -> deFileSize, size);
-            printf("Done\n");
+            fprintf(out, "Done\n");
         }
 
         // We detect a bad cluster in the middle of a FAT chain
@@ -605,23 +1151,36 @@ void fix_corruption(struct disk_info *disk_info) {
         // If it is pointed to (by some other chain), we will trim the file size
         // If it is marked as used but not pointed to, we assume it is from the 
         // current FAT chain, and try to follow it to the end. Adjust file size at the
-        // end
-        if ((info -> anomaly_flag) & CLUSTER_DEAD) {
-            print_diag_message(fullname,
+        // end. A file that starts off the disk has nothing we can find,
+        // so it is left empty
+        if (((info -> anomaly_flag) & CLUSTER_DEAD) &&
+            !in_data_area(start_cluster, bpb)) {
+            print_diag_message(out, fullname,
+                    "starts past the end of the disk.",
+                    "Emptying file... ");
+            putushort(dirent -> deStartCluster, 0);
+            putulong(dirent -> deFileSize, 0);
+            fprintf(out, "Done\n");
+        } else if ((info -> anomaly_flag) & CLUSTER_DEAD) {
+            print_diag_message(out, fullname,
                     "Bad cluster detected.",
                     "Trying to recover... ");
 
             uint16_t cluster = start_cluster;
             uint16_t next_cluster = get_fat_entry(cluster, image_buf, bpb);
             uint32_t cluster_count = 0;
-            while (get_fat_entry(next_cluster, image_buf, bpb) !=
+            // stop at a bad cluster, or a link off the disk
+            while (in_data_area(next_cluster, bpb) &&
+                   get_fat_entry(next_cluster, image_buf, bpb) !=
                    (CLUST_BAD & FAT12_MASK)) {
                 cluster_count++;
                 cluster = next_cluster;
                 next_cluster = get_fat_entry(cluster, image_buf, bpb);
             } 
-            cluster_info[next_cluster] &= CLUSTER_ALLMASK ^ CLUSTER_POINTED;
-            cluster_info[next_cluster] &= CLUSTER_ALLMASK ^ CLUSTER_USED;
+            if (next_cluster < state -> nclusters) {
+                bit_clear(state -> pointed, next_cluster);
+                bit_clear(state -> used, next_cluster);
+            }
             // We know next_cluster is a bad cluster. 
             // So we try get_fat_entry(cluster) + 1
             next_cluster++;
@@ -631,19 +1190,21 @@ void fix_corruption(struct disk_info *disk_info) {
                 next_cluster ++;     
             }
             //printf("Next cluster here is %d\n", next_cluster);
-            if (!(cluster_info[next_cluster] & CLUSTER_POINTED)) {
+            if (in_data_area(next_cluster, bpb) &&
+                !bit_test(state -> pointed, next_cluster)) {
                 cluster_count++;
                 set_fat_entry(cluster, next_cluster, image_buf, bpb);
                 //printf("After this, cluster %d points to %d\n", cluster, get_fat_entry(cluster, image_buf, bpb));
-                while (!is_end_of_file(next_cluster)) {
-                    cluster_info[next_cluster] |= CLUSTER_POINTED;
+                while (!is_end_of_file(next_cluster) &&
+                       next_cluster < state -> nclusters) {
+                    bit_set(state -> pointed, next_cluster);
                     cluster_count++;
                     next_cluster = get_fat_entry(next_cluster, image_buf, bpb);
                 }
 
             } else {
-                print_indent(1);
-                printf("FAILED\n Trimming file... \n");
+                print_indent(out, 1);
+                fprintf(out, "FAILED\n Trimming file... \n");
                 set_fat_entry(cluster, CLUST_EOFS & FAT12_MASK, image_buf, bpb);
             }
 
@@ -651,18 +1212,22 @@ void fix_corruption(struct disk_info *disk_info) {
             size = cluster_count * clusterSize;
             //printf("Cluster count is :%d\n", cluster_count);
             putulong(dirent -> deFileSize, size);
-            printf("Done\n");
+            fprintf(out, "Done\n");
         }
 
 
-        // We detect a loop in the FAT chain
-        // We go until the duplicate starts, and then make it EOF
-        // and update the file size
-        if ((info -> anomaly_flag) & CLUSTER_DUPE) {
-            printf("Fixing %s : loop in chain detected. Cutting loop... Done\n", fullname);
+        // We detect a loop in the FAT chain, or a chain running into
+        // another one. We go until the duplicate starts, and then make
+        // it EOF and update the file size
+        if ((info -> anomaly_flag) & (CLUSTER_DUPE | CLUSTER_CROSS)) {
+            if ((info -> anomaly_flag) & CLUSTER_DUPE) {
+                fprintf(out, "Fixing %s : loop in chain detected. Cutting loop... Done\n", fullname);
+            } else {
+                fprintf(out, "Fixing %s : cross-linked chain detected. Cutting chain... Done\n", fullname);
+            }
             uint16_t cluster = start_cluster;
             uint32_t cluster_count = 1;
-            while (!(cluster_info[cluster] & CLUSTER_DUPE)) {
+            while (!bit_test(state -> dupe, cluster)) {
                 cluster = get_fat_entry(cluster, image_buf, bpb);
                 cluster_count ++;
             }
@@ -676,84 +1241,1480 @@ void fix_corruption(struct disk_info *disk_info) {
         info = info -> next;
     }
 
-    // After fixing the files, we put each orphaned cluster into a new
-    // file under the root directory
-    int orphan_count = 0;
-    for (int i = 2; i < bpb -> bpbSectors; i++) {
-        uint16_t cluster = get_fat_entry(i, image_buf, bpb);
-        if (cluster != (FAT12_MASK & CLUST_BAD)) {
-            if ((cluster_info[i] & CLUSTER_USED) && (!(cluster_info[i] & CLUSTER_POINTED))) {
-                printf("Fixing cluster %d: saving orphaned cluster to root dir\n", i);
+    // We now fix all the pointed to but free sector
+    for (uint32_t w = 0; w < state -> nwords; w++) {
+        uint64_t pointed = state -> pointed[w] & data_clusters(w);
+        for ( ; pointed != 0; pointed &= pointed - 1) {
+            int i = w * 64 + __builtin_ctzll(pointed);
+            uint16_t cluster = get_fat_entry(i, image_buf, bpb);
+            if (cluster == (CLUST_FREE)) {
                 set_fat_entry(i, CLUST_EOFS & FAT12_MASK, image_buf, bpb);
-                orphan_count ++;
-                fullname[0] = '\0';
-                sprintf(fullname, "found%d.dat", orphan_count);
-                print_indent(1);
-                printf("File name is: %s\n", fullname);
-                struct direntry *root = (struct direntry *) root_dir_addr(image_buf, bpb);
-
-                create_dirent(root, fullname, i, clusterSize, image_buf, bpb);
-
-
             }
         }
     }
 
-    // We now fix all the pointed to but free sector
-    for (int i = 2; i < bpb -> bpbSectors; i++) {
-        uint16_t cluster = get_fat_entry(i, image_buf, bpb);
-        if ((cluster == (CLUST_FREE)) && (cluster_info[i] & CLUSTER_POINTED)) {
-            set_fat_entry(i, CLUST_EOFS & FAT12_MASK, image_buf, bpb);
+    // After fixing the files, we save the orphaned chains. The pointed
+    // to but free clusters are done first, so none of them gets taken
+    // for the directory the orphans go in
+    recover_orphans(disk_info);
+}
+
+// Every cluster of every directory the walk went into, once each.
+// Returns how many went into clusters, which has room for num_clusters
+int dir_clusters(struct disk_info *disk_info, uint16_t *clusters) {
+    struct bpb33 *bpb = disk_info -> bpb;
+    uint64_t *seen = calloc((num_clusters(bpb) + 63) / 64, sizeof(uint64_t));
+    int n = 0;
+
+    for (int i = 0; i < disk_info -> nrecs; i++) {
+        struct direntry *dirent = disk_info -> recs[i].dirent;
+        if (dirent == NULL ||
+            (dirent->deAttributes & (ATTR_DIRECTORY | ATTR_HIDDEN)) != ATTR_DIRECTORY) {
+            continue;
+        }
+        uint16_t cluster = disk_info -> recs[i].start;
+        while (in_data_area(cluster, bpb) && !bit_test(seen, cluster)) {
+            bit_set(seen, cluster);
+            clusters[n++] = cluster;
+            cluster = disk_info -> graph.next[cluster];
         }
     }
+    free(seen);
+    return n;
+}
 
-    // Freeing memory used for corruption info
-    info = disk_info -> corr_info;
-    struct corruption_info *next = NULL;
-    while (info != NULL) {
-        next = info -> next;
-        free(info);
-        info = next;
+/*
+ * Checkpoints. With -c we keep <image>.scan next to the image, holding a
+ * hash of every sector ahead of the data area (boot sector, FATs, root
+ * directory), a hash of every directory cluster, and the report from the
+ * last check. Those are all scandisk ever reads, so while they all match
+ * the report can't have changed, and we replay it instead of checking.
+ * The directory clusters come from the checkpoint itself: if the FAT and
+ * every directory we saw are unchanged, so is the set of directories.
+ * Anything changed means a full check: orphans and cross-links depend on
+ * the whole FAT, so there's no re-checking just the parts that moved.
+ * A bad report is only replayed when we aren't going to fix the image;
+ * fixing needs the full check behind it.
+ */
+#define CKPT_MAGIC "SCANCKP1"
+
+struct ckpt_header {
+    char magic[8];
+    uint64_t image_size;
+    uint32_t nsectors;      // sectors ahead of the data area
+    uint32_t ndirs;         // directory clusters
+    int32_t has_error;
+    int32_t file_errors;
+    int32_t cluster_errors;
+    uint32_t report_len;
+};
+
+struct ckpt_dir {
+    uint32_t cluster;
+    uint64_t hash;
+};
+
+// FNV-1a
+uint64_t hash_bytes(uint8_t *p, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
     }
+    return hash;
 }
 
-int main(int argc, char** argv) {
+// Sectors in front of the first data cluster
+uint32_t meta_sectors(struct bpb33 *bpb) {
+    int bps = bpb -> bpbBytesPerSec;
+    return bpb -> bpbResSectors + bpb -> bpbFATs * bpb -> bpbFATsecs +
+           (bpb -> bpbRootDirEnts * sizeof(struct direntry) + bps - 1) / bps;
+}
+
+char *checkpoint_path(char *image) {
+    char *path = malloc(strlen(image) + 6);
+    sprintf(path, "%s.scan", image);
+    return path;
+}
+
+// If nothing scandisk reads has changed since the checkpoint, return the
+// report it holds, and fill in what the check found then
+char *checkpoint_replay(struct disk_info *disk_info, int *has_error,
+                        size_t *report_len) {
+    uint8_t *image_buf = disk_info -> image_buf;
+    struct bpb33 *bpb = disk_info -> bpb;
+    uint32_t bps = bpb -> bpbBytesPerSec;
+    uint32_t cluster_size = bps * bpb -> bpbSecPerClust;
+    struct ckpt_header header;
+    char *report = NULL;
+    int ok = 0;
+
+    FILE *f = fopen(disk_info -> checkpoint, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+        memcmp(header.magic, CKPT_MAGIC, 8) != 0 ||
+        header.image_size != image_size(image_buf) ||
+        header.nsectors != meta_sectors(bpb)) {
+        goto out;
+    }
+    for (uint32_t i = 0; i < header.nsectors; i++) {
+        uint64_t hash;
+        if (fread(&hash, sizeof(hash), 1, f) != 1 ||
+            hash != hash_bytes(image_buf + i * bps, bps)) {
+            goto out;
+        }
+    }
+    for (uint32_t i = 0; i < header.ndirs; i++) {
+        struct ckpt_dir dir;
+        if (fread(&dir, sizeof(dir), 1, f) != 1 ||
+            !in_data_area(dir.cluster, bpb) ||
+            dir.hash != hash_bytes(cluster_to_addr(dir.cluster, image_buf, bpb),
+                                   cluster_size)) {
+            goto out;
+        }
+    }
+    report = malloc(header.report_len);
+    if (fread(report, 1, header.report_len, f) != header.report_len) {
+        goto out;
+    }
+    *has_error = header.has_error;
+    *report_len = header.report_len;
+    disk_info -> file_errors = header.file_errors;
+    disk_info -> cluster_errors = header.cluster_errors;
+    ok = 1;
+out:
+    fclose(f);
+    if (!ok) {
+        free(report);
+        report = NULL;
+    }
+    return report;
+}
+
+// Save the checkpoint for the image as it stands after the check. It is
+// written aside and renamed into place, so a crash leaves the old one
+void checkpoint_save(struct disk_info *disk_info, int has_error,
+                     char *report, size_t report_len) {
+    uint8_t *image_buf = disk_info -> image_buf;
+    struct bpb33 *bpb = disk_info -> bpb;
+    uint32_t bps = bpb -> bpbBytesPerSec;
+    uint32_t cluster_size = bps * bpb -> bpbSecPerClust;
+    uint16_t *clusters = malloc(num_clusters(bpb) * sizeof(uint16_t));
+    struct ckpt_dir *dirs = malloc(num_clusters(bpb) * sizeof(struct ckpt_dir));
+    struct ckpt_header header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CKPT_MAGIC, 8);
+    header.image_size = image_size(image_buf);
+    header.nsectors = meta_sectors(bpb);
+    header.has_error = has_error;
+    header.file_errors = disk_info -> file_errors;
+    header.cluster_errors = disk_info -> cluster_errors;
+    header.report_len = report_len;
+
+    header.ndirs = dir_clusters(disk_info, clusters);
+    for (uint32_t i = 0; i < header.ndirs; i++) {
+        dirs[i].cluster = clusters[i];
+        dirs[i].hash = hash_bytes(cluster_to_addr(clusters[i], image_buf, bpb),
+                                  cluster_size);
+    }
+
+    char *tmp = malloc(strlen(disk_info -> checkpoint) + 5);
+    sprintf(tmp, "%s.tmp", disk_info -> checkpoint);
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write checkpoint %s: %s\n", tmp, strerror(errno));
+    } else {
+        fwrite(&header, sizeof(header), 1, f);
+        for (uint32_t i = 0; i < header.nsectors; i++) {
+            uint64_t hash = hash_bytes(image_buf + i * bps, bps);
+            fwrite(&hash, sizeof(hash), 1, f);
+        }
+        fwrite(dirs, sizeof(struct ckpt_dir), header.ndirs, f);
+        fwrite(report, 1, report_len, f);
+        if (fclose(f) != 0 || rename(tmp, disk_info -> checkpoint) != 0) {
+            fprintf(stderr, "Cannot write checkpoint %s: %s\n",
+                    disk_info -> checkpoint, strerror(errno));
+            unlink(tmp);
+        }
+    }
+    free(tmp);
+    free(dirs);
+    free(clusters);
+}
+
+/*
+ * Repair plans. The check and the fixes run on a copy-on-write mapping,
+ * so they never reach the file. What the fixes did is read back as a
+ * plan by comparing the FATs, the root directory and every directory
+ * cluster with the file: each FAT entry, file size or directory entry
+ * that differs is one edit. Applying a plan checks every edit against
+ * the image before touching it, logs the way back, and then makes all
+ * the edits in offset order in one go.
+ */
+
+// Where FAT copy starts, the same way get_fat_entry() finds the first
+uint32_t fat_offset(struct bpb33 *bpb, int copy) {
+    return bpb -> bpbResSectors * bpb -> bpbBytesPerSec * bpb -> bpbSecPerClust +
+           copy * bpb -> bpbFATsecs * bpb -> bpbBytesPerSec;
+}
+
+// Where in the image an edit lands, to put them in order
+uint32_t edit_offset(struct plan_edit *edit, struct bpb33 *bpb) {
+    if (edit -> kind == EDIT_FAT) {
+        return fat_offset(bpb, edit -> copy) + 3 * (edit -> cluster / 2);
+    }
+    return edit -> offset;
+}
+
+struct plan_edit *add_edit(struct repair_plan *plan, char kind) {
+    if (plan -> nedits == plan -> cap) {
+        plan -> cap = plan -> cap ? plan -> cap * 2 : 64;
+        plan -> edits = realloc(plan -> edits,
+                                plan -> cap * sizeof(struct plan_edit));
+    }
+    struct plan_edit *edit = &plan -> edits[plan -> nedits++];
+    memset(edit, 0, sizeof(struct plan_edit));
+    edit -> kind = kind;
+    return edit;
+}
+
+// Compare the directory entries in len bytes at offset
+void diff_dirents(struct repair_plan *plan, uint32_t offset, uint8_t *old,
+                  uint8_t *new, uint32_t len) {
+    uint32_t size_at = offsetof(struct direntry, deFileSize);
+
+    for (uint32_t i = 0; i + sizeof(struct direntry) <= len; i += sizeof(struct direntry)) {
+        if (memcmp(old + i, new + i, sizeof(struct direntry)) == 0) {
+            continue;
+        }
+        if (memcmp(old + i, new + i, size_at) == 0) {
+            struct plan_edit *edit = add_edit(plan, EDIT_SIZE);
+            edit -> offset = offset + i + size_at;
+            edit -> old = getulong(old + i + size_at);
+            edit -> new = getulong(new + i + size_at);
+        } else {
+            struct plan_edit *edit = add_edit(plan, EDIT_DIRENT);
+            edit -> offset = offset + i;
+            memcpy(edit -> old_dirent, old + i, sizeof(struct direntry));
+            memcpy(edit -> new_dirent, new + i, sizeof(struct direntry));
+        }
+    }
+}
+
+// Read back what the fixes did to the mapping as a plan
+void make_plan(struct disk_info *disk_info) {
+    uint8_t *image_buf = disk_info -> image_buf;
+    struct bpb33 *bpb = disk_info -> bpb;
+    struct repair_plan *plan = disk_info -> plan;
+    uint32_t cluster_size = bpb -> bpbBytesPerSec * bpb -> bpbSecPerClust;
+    uint32_t meta = meta_sectors(bpb) * bpb -> bpbBytesPerSec;
+    uint8_t *orig = malloc(meta > cluster_size ? meta : cluster_size);
+
+    plan -> image_size = image_size(image_buf);
+    if (pread(disk_info -> fd, orig, meta, 0) != meta) {
+        fprintf(stderr, "Cannot read the image back: %s\n", strerror(errno));
+        exit(1);
+    }
+    for (int copy = 0; copy < bpb -> bpbFATs; copy++) {
+        uint32_t base = fat_offset(bpb, copy) - fat_offset(bpb, 0);
+        for (uint32_t i = 0; i < fat_entries(bpb); i++) {
+            uint16_t old = get_fat_entry(i, orig + base, bpb);
+            uint16_t new = get_fat_entry(i, image_buf + base, bpb);
+            if (old != new) {
+                struct plan_edit *edit = add_edit(plan, EDIT_FAT);
+                edit -> copy = copy;
+                edit -> cluster = i;
+                edit -> old = old;
+                edit -> new = new;
+            }
+        }
+    }
+    uint32_t root = root_dir_addr(image_buf, bpb) - image_buf;
+    diff_dirents(plan, root, orig + root, image_buf + root,
+                 bpb -> bpbRootDirEnts * sizeof(struct direntry));
+
+    uint16_t *clusters = malloc(num_clusters(bpb) * sizeof(uint16_t));
+    int n = dir_clusters(disk_info, clusters);
+    for (int i = 0; i < n; i++) {
+        uint8_t *p = cluster_to_addr(clusters[i], image_buf, bpb);
+        if (pread(disk_info -> fd, orig, cluster_size, p - image_buf) != cluster_size) {
+            fprintf(stderr, "Cannot read the image back: %s\n", strerror(errno));
+            exit(1);
+        }
+        diff_dirents(plan, p - image_buf, orig, p, cluster_size);
+    }
+    // the directory the orphans went into was free space before
+    for (int i = 0; i < disk_info -> nfound; i++) {
+        uint8_t *p = cluster_to_addr(disk_info -> found[i], image_buf, bpb);
+        if (pread(disk_info -> fd, orig, cluster_size, p - image_buf) != cluster_size) {
+            fprintf(stderr, "Cannot read the image back: %s\n", strerror(errno));
+            exit(1);
+        }
+        diff_dirents(plan, p - image_buf, orig, p, cluster_size);
+    }
+    free(clusters);
+    free(orig);
+}
+
+void free_plan(struct repair_plan *plan) {
+    free(plan -> edits);
+    plan -> edits = NULL;
+    plan -> nedits = plan -> cap = 0;
+}
+
+// Write the plan out; with undo set, the plan that takes it back
+int write_plan(struct repair_plan *plan, char *path, int undo) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fprintf(f, "scandisk-plan %llu\n", (unsigned long long)plan -> image_size);
+    for (int i = 0; i < plan -> nedits; i++) {
+        struct plan_edit *edit = &plan -> edits[i];
+        uint32_t old = undo ? edit -> new : edit -> old;
+        uint32_t new = undo ? edit -> old : edit -> new;
+        if (edit -> kind == EDIT_FAT) {
+            fprintf(f, "fat %d %d %03x %03x\n", edit -> copy, edit -> cluster, old, new);
+        } else if (edit -> kind == EDIT_SIZE) {
+            fprintf(f, "size %u %u %u\n", edit -> offset, old, new);
+        } else {
+            uint8_t *from = undo ? edit -> new_dirent : edit -> old_dirent;
+            uint8_t *to = undo ? edit -> old_dirent : edit -> new_dirent;
+            fprintf(f, "dirent %u ", edit -> offset);
+            for (int k = 0; k < sizeof(struct direntry); k++) {
+                fprintf(f, "%02x", from[k]);
+            }
+            fprintf(f, " ");
+            for (int k = 0; k < sizeof(struct direntry); k++) {
+                fprintf(f, "%02x", to[k]);
+            }
+            fprintf(f, "\n");
+        }
+    }
+    // the undo log has to be on disk before the image changes
+    if (fflush(f) != 0 || (undo && fsync(fileno(f)) != 0) || fclose(f) != 0) {
+        fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int parse_hex(char *hex, uint8_t *bytes, int len) {
+    if (strlen(hex) != 2 * len) {
+        return -1;
+    }
+    for (int i = 0; i < len; i++) {
+        unsigned int byte;
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return -1;
+        }
+        bytes[i] = byte;
+    }
+    return 0;
+}
+
+int read_plan(struct repair_plan *plan, char *path) {
+    FILE *f = fopen(path, "r");
+    char line[256], old[80], new[80];
+    unsigned long long size;
+    unsigned int a, b, c, d;
+    int lineno = 1;
+
+    memset(plan, 0, sizeof(struct repair_plan));
+    if (f == NULL) {
+        fprintf(stderr, "Cannot read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (fgets(line, sizeof(line), f) == NULL ||
+        sscanf(line, "scandisk-plan %llu", &size) != 1) {
+        fprintf(stderr, "%s is not a repair plan\n", path);
+        fclose(f);
+        return -1;
+    }
+    plan -> image_size = size;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        lineno ++;
+        if (sscanf(line, "fat %u %u %x %x", &a, &b, &c, &d) == 4) {
+            struct plan_edit *edit = add_edit(plan, EDIT_FAT);
+            edit -> copy = a;
+            edit -> cluster = b;
+            edit -> old = c;
+            edit -> new = d;
+        } else if (sscanf(line, "size %u %u %u", &a, &c, &d) == 3) {
+            struct plan_edit *edit = add_edit(plan, EDIT_SIZE);
+            edit -> offset = a;
+            edit -> old = c;
+            edit -> new = d;
+        } else if (sscanf(line, "dirent %u %79s %79s", &a, old, new) == 3) {
+            struct plan_edit *edit = add_edit(plan, EDIT_DIRENT);
+            edit -> offset = a;
+            if (parse_hex(old, edit -> old_dirent, sizeof(struct direntry)) < 0 ||
+                parse_hex(new, edit -> new_dirent, sizeof(struct direntry)) < 0) {
+                goto bad;
+            }
+        } else {
+            goto bad;
+        }
+    }
+    fclose(f);
+    return 0;
+bad:
+    fprintf(stderr, "%s:%d: bad edit\n", path, lineno);
+    fclose(f);
+    free_plan(plan);
+    return -1;
+}
+
+static struct bpb33 *sort_bpb;
+
+int compare_edits(const void *a, const void *b) {
+    uint32_t x = edit_offset((struct plan_edit *)a, sort_bpb);
+    uint32_t y = edit_offset((struct plan_edit *)b, sort_bpb);
+    return x < y ? -1 : x > y;
+}
+
+// What the image holds where the edit goes: 0 the old value, 1 the new
+// one (applied already), -1 neither, or somewhere the edit can't go
+int edit_state(struct plan_edit *edit, uint8_t *image_buf, struct bpb33 *bpb,
+               uint64_t size) {
+    uint8_t *fat = image_buf + fat_offset(bpb, edit -> copy) - fat_offset(bpb, 0);
+    uint32_t value;
+
+    switch (edit -> kind) {
+    case EDIT_FAT:
+        if (edit -> copy >= bpb -> bpbFATs || edit -> cluster >= fat_entries(bpb)) {
+            return -1;
+        }
+        value = get_fat_entry(edit -> cluster, fat, bpb);
+        break;
+    case EDIT_SIZE:
+        if ((uint64_t)edit -> offset + 4 > size) {
+            return -1;
+        }
+        value = getulong(image_buf + edit -> offset);
+        break;
+    default:
+        if ((uint64_t)edit -> offset + sizeof(struct direntry) > size) {
+            return -1;
+        }
+        if (memcmp(image_buf + edit -> offset, edit -> old_dirent,
+                   sizeof(struct direntry)) == 0) {
+            return 0;
+        }
+        if (memcmp(image_buf + edit -> offset, edit -> new_dirent,
+                   sizeof(struct direntry)) == 0) {
+            return 1;
+        }
+        return -1;
+    }
+    return value == edit -> old ? 0 : (value == edit -> new ? 1 : -1);
+}
+
+/*
+ * Make every edit of the plan to the image, or none of them. Edits the
+ * image already has are left alone, so a plan cut short by a crash can
+ * be applied again, and so can its undo log. With undo set, the plan
+ * that takes the image back goes there before anything is written.
+ */
+int apply_plan(struct repair_plan *plan, char *image, char *undo) {
+    int fd, ret = -1;
+    uint8_t *image_buf = map_image(image, &fd, 0);
+
+    if (image_buf == NULL) {
+        return -1;
+    }
+    if (lock_image(fd, F_WRLCK) < 0) {
+        unmmap_file(image_buf, &fd);
+        return -1;
+    }
+    struct bpb33 *bpb = check_bootsector(image_buf);
+    uint64_t size = image_size(image_buf);
+
+    if (size != plan -> image_size || !image_is_sane(bpb, size)) {
+        fprintf(stderr, "The plan is for a different image\n");
+        goto out;
+    }
+    sort_bpb = bpb;
+    qsort(plan -> edits, plan -> nedits, sizeof(struct plan_edit), compare_edits);
+    for (int i = 0; i < plan -> nedits; i++) {
+        if (edit_state(&plan -> edits[i], image_buf, bpb, size) < 0) {
+            fprintf(stderr, "The image has changed since the plan was made "
+                    "(at offset %u); nothing applied\n",
+                    edit_offset(&plan -> edits[i], bpb));
+            goto out;
+        }
+    }
+    if (undo != NULL && write_plan(plan, undo, 1) < 0) {
+        goto out;
+    }
+
+    uint32_t low = UINT32_MAX, high = 0;
+    for (int i = 0; i < plan -> nedits; i++) {
+        struct plan_edit *edit = &plan -> edits[i];
+        uint32_t offset = edit_offset(edit, bpb);
+        if (edit_state(edit, image_buf, bpb, size) == 1) {
+            continue;
+        }
+        if (edit -> kind == EDIT_FAT) {
+            uint8_t *fat = image_buf + fat_offset(bpb, edit -> copy) - fat_offset(bpb, 0);
+            set_fat_entry(edit -> cluster, edit -> new, fat, bpb);
+        } else if (edit -> kind == EDIT_SIZE) {
+            putulong(image_buf + edit -> offset, edit -> new);
+        } else {
+            memcpy(image_buf + edit -> offset, edit -> new_dirent,
+                   sizeof(struct direntry));
+        }
+        low = offset < low ? offset : low;
+        high = offset + sizeof(struct direntry) > high ? offset + sizeof(struct direntry) : high;
+    }
+    if (low < high) {
+        uint32_t page = sysconf(_SC_PAGESIZE);
+        low -= low % page;
+        high = high > size ? size : high;
+        msync(image_buf + low, high - low, MS_SYNC);
+    }
+    ret = 0;
+out:
+    lock_image(fd, F_UNLCK);
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    return ret;
+}
+
+/*
+ * Checking in a bounded amount of memory. The check above keeps a few
+ * bytes for every cluster of the volume; when --mem-limit leaves less
+ * than that, the FAT and who owns each cluster are taken a window of
+ * clusters at a time instead. The FAT comes straight from the file, the
+ * owners of the windows not in memory wait in a temporary file, and a
+ * chain going into another window is spilled to a second one until
+ * that window comes round. Only the check works this way: the fixes
+ * need the state of the whole volume at once.
+ */
+
+#define IN_MEMORY_BYTES 17      // graph, owner and bitsets, per cluster
+#define SPILL_MIN 64            // chain links buffered, at the least
+#define SPILL_MAX 4096          // and at the most
+
+struct spill_link {
+    uint32_t cluster;   // where the chain goes
+    uint32_t label;     // record + 1 of the chain it is on
+};
+
+struct spill_block {
+    int64_t prev;       // the window's block before this one, or -1
+    uint32_t count;     // links that follow
+};
+
+struct window_scan {
+    int fd;                 // the image, read rather than mapped
+    struct bpb33 *bpb;
+    uint32_t nclusters;
+    uint32_t size;          // clusters in a window, a multiple of 64
+    uint32_t nwindows;
+    uint32_t loaded;        // the window in memory, nwindows for none
+    int dirty;              // its owners changed since it was loaded
+    uint8_t *fat;           // its part of the FAT
+    uint16_t *value;        // its FAT entries
+    uint32_t *owner;        // record + 1 owning each cluster, 0 for none
+    FILE *owners;           // the owners of every window
+    FILE *spill;            // links waiting for their window, in blocks
+    int64_t *head;          // each window's last block, -1 for none
+    int64_t spill_end;
+    struct spill_link *out; // links not spilled yet
+    struct spill_link *in;  // links read back
+    int nout;
+    int nlinks;             // room in out and in
+};
+
+void window_io(ssize_t done, size_t len) {
+    if (done < 0 || (size_t)done != len) {
+        fprintf(stderr, "Cannot read or write the scan windows: %s\n",
+                done < 0 ? strerror(errno) : "short transfer");
+        exit(1);
+    }
+}
+
+// Split mem_limit between the spill buffers and the window. NULL if the
+// temporary files can't be made
+struct window_scan *window_open(int fd, struct bpb33 *bpb, size_t mem_limit) {
+    struct window_scan *ws = calloc(1, sizeof(struct window_scan));
+    size_t links = mem_limit / 4 / sizeof(struct spill_link);
+    size_t left;
+
+    ws -> nlinks = links < SPILL_MIN ? SPILL_MIN : links > SPILL_MAX ? SPILL_MAX : links;
+    left = mem_limit - 2 * ws -> nlinks * sizeof(struct spill_link);
+    if (left > mem_limit) {
+        left = 0;
+    }
+    // FAT bytes, entries and owners come to 7.5 bytes a cluster
+    ws -> fd = fd;
+    ws -> bpb = bpb;
+    ws -> nclusters = num_clusters(bpb);
+    ws -> size = left / 8 / 64 * 64;
+    if (ws -> size < 64) {
+        ws -> size = 64;
+    }
+    if (ws -> size > (ws -> nclusters + 63) / 64 * 64) {
+        ws -> size = (ws -> nclusters + 63) / 64 * 64;
+    }
+    ws -> nwindows = (ws -> nclusters + ws -> size - 1) / ws -> size;
+    ws -> loaded = ws -> nwindows;
+    ws -> owners = tmpfile();
+    ws -> spill = tmpfile();
+    if (ws -> owners == NULL || ws -> spill == NULL ||
+        ftruncate(fileno(ws -> owners),
+                  (off_t)ws -> nwindows * ws -> size * sizeof(uint32_t)) < 0) {
+        fprintf(stderr, "Cannot make the scan windows: %s\n", strerror(errno));
+        if (ws -> owners != NULL) {
+            fclose(ws -> owners);
+        }
+        if (ws -> spill != NULL) {
+            fclose(ws -> spill);
+        }
+        free(ws);
+        return NULL;
+    }
+    ws -> fat = malloc(ws -> size * 3 / 2);
+    ws -> value = malloc(ws -> size * sizeof(uint16_t));
+    ws -> owner = malloc(ws -> size * sizeof(uint32_t));
+    ws -> head = malloc(ws -> nwindows * sizeof(int64_t));
+    for (uint32_t k = 0; k < ws -> nwindows; k++) {
+        ws -> head[k] = -1;
+    }
+    ws -> out = malloc(ws -> nlinks * sizeof(struct spill_link));
+    ws -> in = malloc(ws -> nlinks * sizeof(struct spill_link));
+    return ws;
+}
+
+void window_close(struct window_scan *ws) {
+    fclose(ws -> owners);
+    fclose(ws -> spill);
+    free(ws -> fat);
+    free(ws -> value);
+    free(ws -> owner);
+    free(ws -> head);
+    free(ws -> out);
+    free(ws -> in);
+    free(ws);
+}
+
+// Bring window k into memory, putting back the owners of the one there
+void window_load(struct window_scan *ws, uint32_t k) {
+    int owners = fileno(ws -> owners);
+    size_t len = ws -> size * sizeof(uint32_t);
+
+    if (ws -> loaded == k) {
+        return;
+    }
+    if (ws -> dirty) {
+        window_io(pwrite(owners, ws -> owner, len, (off_t)ws -> loaded * len), len);
+        ws -> dirty = 0;
+    }
+
+    // The window starts at an even cluster, so on a whole FAT12 byte
+    uint32_t first = k * ws -> size;
+    size_t fat_len = ws -> size * 3 / 2;
+    ssize_t got = pread(ws -> fd, ws -> fat, fat_len,
+                        fat_offset(ws -> bpb, 0) + first / 2 * 3);
+    if (got < 0) {
+        window_io(got, fat_len);
+    }
+    // the last window can run off the end of the image
+    memset(ws -> fat + got, 0, fat_len - got);
+    for (uint32_t j = 0; j < ws -> size; j++) {
+        uint8_t *p = ws -> fat + 3 * (j / 2);
+        if (first + j >= ws -> nclusters) {
+            ws -> value[j] = CLUST_FREE;
+        } else if (j % 2 == 0) {
+            ws -> value[j] = ((0x0f & p[1]) << 8) | p[0];
+        } else {
+            ws -> value[j] = p[2] << 4 | ((0xf0 & p[1]) >> 4);
+        }
+    }
+    window_io(pread(owners, ws -> owner, len, (off_t)k * len), len);
+    ws -> loaded = k;
+}
+
+// The FAT entry of cluster, loading its window if need be
+uint16_t window_value(struct window_scan *ws, uint16_t cluster) {
+    window_load(ws, cluster / ws -> size);
+    return ws -> value[cluster % ws -> size];
+}
+
+// Where the chain goes after cluster, 0 where it stops, as graph -> next
+uint16_t window_next(struct window_scan *ws, uint16_t cluster) {
+    uint16_t next = window_value(ws, cluster);
+    return is_valid_cluster(next, ws -> bpb) && next < ws -> nclusters ? next : 0;
+}
+
+uint32_t window_owner(struct window_scan *ws, uint16_t cluster) {
+    window_load(ws, cluster / ws -> size);
+    return ws -> owner[cluster % ws -> size];
+}
+
+int compare_links(const void *a, const void *b) {
+    const struct spill_link *x = a, *y = b;
+    return (x -> cluster > y -> cluster) - (x -> cluster < y -> cluster);
+}
+
+// Write out the links waiting, one block for each window they go to
+void spill_flush(struct window_scan *ws) {
+    int spill = fileno(ws -> spill);
+
+    qsort(ws -> out, ws -> nout, sizeof(struct spill_link), compare_links);
+    for (int i = 0, j; i < ws -> nout; i = j) {
+        uint32_t k = ws -> out[i].cluster / ws -> size;
+        for (j = i; j < ws -> nout && ws -> out[j].cluster / ws -> size == k; j++) {
+        }
+        struct spill_block block;
+        size_t len = (j - i) * sizeof(struct spill_link);
+        memset(&block, 0, sizeof(block));
+        block.prev = ws -> head[k];
+        block.count = j - i;
+        window_io(pwrite(spill, &block, sizeof(block), ws -> spill_end),
+                  sizeof(block));
+        window_io(pwrite(spill, &ws -> out[i], len, ws -> spill_end + sizeof(block)),
+                  len);
+        ws -> head[k] = ws -> spill_end;
+        ws -> spill_end += sizeof(block) + len;
+    }
+    ws -> nout = 0;
+}
+
+void spill_link(struct window_scan *ws, uint16_t cluster, uint32_t label) {
+    if (ws -> nout == ws -> nlinks) {
+        spill_flush(ws);
+    }
+    ws -> out[ws -> nout].cluster = cluster;
+    ws -> out[ws -> nout].label = label;
+    ws -> nout ++;
+}
+
+// Give label the clusters of the chain from cluster, as far as it stays
+// in the loaded window, wherever it is lower than the owner they have
+void window_claim(struct window_scan *ws, uint16_t cluster, uint32_t label) {
+    uint32_t first = ws -> loaded * ws -> size;
+
+    while (1) {
+        uint32_t *owner = &ws -> owner[cluster - first];
+        if (*owner != 0 && *owner <= label) {
+            return;
+        }
+        *owner = label;
+        ws -> dirty = 1;
+        uint16_t next = window_next(ws, cluster);
+        if (next == 0) {
+            return;
+        }
+        if (next / ws -> size != ws -> loaded) {
+            spill_link(ws, next, label);
+            return;
+        }
+        cluster = next;
+    }
+}
+
+// What claim_chain() works out, a window at a time: every cluster goes
+// to the first record that reaches it. The lowest label wins wherever
+// it gets to, so the windows can take their links in any order, and we
+// go round them until nothing is left waiting
+void window_claim_chains(struct disk_info *disk_info) {
+    struct window_scan *ws = disk_info -> windows;
+    int spill = fileno(ws -> spill);
+    int busy = 1;
+
+    for (int i = 0; i < disk_info -> nrecs; i++) {
+        struct scan_rec *rec = &disk_info -> recs[i];
+        if (rec -> kind != REC_NONE && in_data_area(rec -> start, disk_info -> bpb)) {
+            spill_link(ws, rec -> start, i + 1);
+        }
+    }
+    while (busy) {
+        busy = 0;
+        for (uint32_t k = 0; k < ws -> nwindows; k++) {
+            spill_flush(ws);
+            int64_t at = ws -> head[k];
+            if (at < 0) {
+                continue;
+            }
+            ws -> head[k] = -1;
+            busy = 1;
+            window_load(ws, k);
+            while (at >= 0) {
+                struct spill_block block;
+                window_io(pread(spill, &block, sizeof(block), at), sizeof(block));
+                off_t from = at + sizeof(block);
+                for (uint32_t done = 0; done < block.count; ) {
+                    uint32_t n = block.count - done;
+                    if (n > (uint32_t)ws -> nlinks) {
+                        n = ws -> nlinks;
+                    }
+                    size_t len = n * sizeof(struct spill_link);
+                    window_io(pread(spill, ws -> in, len, from), len);
+                    for (uint32_t l = 0; l < n; l++) {
+                        window_claim(ws, ws -> in[l].cluster, ws -> in[l].label);
+                    }
+                    from += len;
+                    done += n;
+                }
+                at = block.prev;
+            }
+        }
+    }
+    // every link has been taken in, so give the space back
+    ws -> spill_end = 0;
+    window_io(ftruncate(spill, 0), 0);
+}
+
+// Does the chain from cluster come back round to it? Brent's method
+// finds how long the cycle it ends in is without remembering the way
+int window_on_cycle(struct window_scan *ws, uint16_t cluster) {
+    uint16_t tortoise = cluster;
+    uint16_t hare = window_next(ws, cluster);
+    uint32_t power = 1, lam = 1;
+
+    while (hare != 0 && hare != tortoise) {
+        if (power == lam) {
+            tortoise = hare;
+            power *= 2;
+            lam = 0;
+        }
+        hare = window_next(ws, hare);
+        lam ++;
+    }
+    if (hare == 0) {
+        return 0;
+    }
+    hare = cluster;
+    for (uint32_t k = 0; k < lam; k++) {
+        hare = window_next(ws, hare);
+    }
+    return hare == cluster;
+}
+
+// The next cluster of a file's own part of its chain, 0 at the end
+uint16_t window_own_next(struct window_scan *ws, uint16_t cluster,
+                         uint32_t label) {
+    uint16_t next = window_next(ws, cluster);
+    return next != 0 && window_owner(ws, next) == label ? next : 0;
+}
+
+// What check_chain() finds, without the FAT graph: walk the clusters
+// the file owns, with Brent's method again to see it come back round
+// on itself, and then look at why it stopped
+void window_check_chain(struct disk_info *disk_info, int i) {
+    struct window_scan *ws = disk_info -> windows;
+    struct scan_rec *rec = &disk_info -> recs[i];
+    struct bpb33 *bpb = disk_info -> bpb;
+
+    if (rec -> kind != REC_FILE) {
+        return;
+    }
+
+    uint32_t size = getulong(rec -> dirent->deFileSize);
+    uint16_t sectorSize = bpb -> bpbBytesPerSec;
+    uint32_t num_of_cluster = (size + sectorSize - 1) / sectorSize;
+    uint16_t anomaly_flag = CLUSTER_ZEROMASK;
+    uint16_t cluster = rec -> start;
+    uint32_t cluster_count = 0;
+
+    if (cluster == 0) {
+        anomaly_flag |= CLUSTER_NULL;
+    } else if (!in_data_area(cluster, bpb)) {
+        anomaly_flag |= CLUSTER_DEAD;
+    } else {
+        uint32_t label = i + 1;
+        uint16_t tortoise = cluster;
+        uint32_t power = 1, lam = 0;
+        int looped = 0;
+        while (1) {
+            cluster_count ++;
+            uint16_t next = window_own_next(ws, cluster, label);
+            if (next == 0) {
+                break;
+            }
+            cluster = next;
+            lam ++;
+            if (cluster == tortoise) {
+                looped = 1;
+                break;
+            }
+            if (lam == power) {
+                tortoise = cluster;
+                power *= 2;
+                lam = 0;
+            }
+        }
+
+        if (looped) {
+            // Comes back round on itself: count up to where it does
+            uint16_t slow = rec -> start, fast = rec -> start;
+            for (uint32_t k = 0; k < lam; k++) {
+                fast = window_own_next(ws, fast, label);
+            }
+            cluster_count = lam;
+            while (slow != fast) {
+                slow = window_own_next(ws, slow, label);
+                fast = window_own_next(ws, fast, label);
+                cluster_count ++;
+            }
+            anomaly_flag |= CLUSTER_DUPE;
+        } else if (window_next(ws, cluster) != 0) {
+            // Runs into a chain we have been down before
+            if (window_on_cycle(ws, window_next(ws, cluster))) {
+                anomaly_flag |= CLUSTER_DUPE;
+            } else {
+                anomaly_flag |= CLUSTER_CROSS;
+            }
+        } else if (!is_end_of_file(window_value(ws, cluster))) {
+            anomaly_flag |= CLUSTER_DEAD;
+        } else if (num_of_cluster > cluster_count) {
+            anomaly_flag |= CLUSTER_LESS;
+        }
+    }
+
+    if (num_of_cluster < cluster_count) {
+        anomaly_flag |= CLUSTER_MORE;
+    }
+
+    rec -> expected = num_of_cluster;
+    rec -> count = cluster_count;
+    rec -> anomaly_flag = anomaly_flag;
+}
+
+// validify_cluster_info() for each window in turn
+int window_validify(struct disk_info *disk_info) {
+    struct window_scan *ws = disk_info -> windows;
+    int has_error = 0;
+
+    for (uint32_t k = 0; k < ws -> nwindows; k++) {
+        window_load(ws, k);
+        for (uint32_t w = 0; w < ws -> size / 64; w++) {
+            uint64_t used = 0, bad = 0, pointed = 0;
+            for (uint32_t b = 0; b < 64; b++) {
+                uint32_t j = w * 64 + b;
+                if (ws -> value[j] == (FAT12_MASK & CLUST_BAD)) {
+                    bad |= BIT_MASK(b);
+                } else if (ws -> value[j] != CLUST_FREE) {
+                    used |= BIT_MASK(b);
+                }
+                if (ws -> owner[j] != 0) {
+                    pointed |= BIT_MASK(b);
+                }
+            }
+            has_error |= report_cluster_word(disk_info, k * ws -> size / 64 + w,
+                                             used, bad, pointed);
+        }
+    }
+    return has_error;
+}
+
+// Check one mapped image, and fix it too if asked. Returns whether
+// anything was wrong with it
+int scan_image(struct disk_info *disk_info, int fix) {
+    FILE *out = disk_info -> out;
+    struct bpb33 *bpb = disk_info -> bpb;
+    int has_error;
+    char *report = NULL;
+    size_t report_len = 0;
+
+    disk_info -> file_errors = 0;
+    disk_info -> cluster_errors = 0;
+    if (disk_info -> checkpoint != NULL) {
+        report = checkpoint_replay(disk_info, &has_error, &report_len);
+        if (report != NULL && !(has_error && fix)) {
+            fwrite(report, 1, report_len, out);
+            free(report);
+            return has_error;
+        }
+        free(report);
+        report = NULL;
+        report_len = 0;
+        disk_info -> file_errors = 0;
+        disk_info -> cluster_errors = 0;
+        // keep the report to save along with the checkpoint
+        disk_info -> out = open_memstream(&report, &report_len);
+    }
+
+    // Not enough room for the whole volume: take it a window at a time
+    disk_info -> windows = NULL;
+    if (disk_info -> mem_limit != 0 &&
+        (size_t)num_clusters(bpb) * IN_MEMORY_BYTES > disk_info -> mem_limit) {
+        disk_info -> windows = window_open(disk_info -> fd, bpb,
+                                           disk_info -> mem_limit);
+        if (disk_info -> windows == NULL) {
+            exit(1);
+        }
+        memset(&disk_info -> state, 0, sizeof(struct cluster_state));
+        memset(&disk_info -> graph, 0, sizeof(struct fat_graph));
+    } else {
+        alloc_cluster_state(&disk_info -> state, num_clusters(bpb));
+    }
+    disk_info -> corr_info = NULL;
+    disk_info -> found = NULL;
+    disk_info -> nfound = 0;
+    disk_info -> recs = NULL;
+    disk_info -> nrecs = 0;
+    disk_info -> owner = NULL;
+
+    fprintf(disk_info -> out, "==================\n");
+   
+    has_error = data_is_inconsistent(disk_info);
+    if (has_error) {
+        if (fix && disk_info -> windows != NULL) {
+            fprintf(disk_info -> out, "Not fixing: that needs more memory than --mem-limit\n");
+        } else if (fix) {
+            fix_corruption(disk_info);
+            if (disk_info -> plan != NULL) {
+                make_plan(disk_info);
+            }
+        }
+    } else {
+        fprintf(disk_info -> out, "Yay we are free of error!\n");
+    }
+
+    if (disk_info -> checkpoint != NULL) {
+        fclose(disk_info -> out);
+        disk_info -> out = out;
+        fwrite(report, 1, report_len, out);
+        // a fix changes the image, so the report no longer describes it,
+        // and the directory clusters to hash come from the FAT graph
+        if (!(has_error && fix) && disk_info -> windows == NULL) {
+            checkpoint_save(disk_info, has_error, report, report_len);
+        }
+        free(report);
+    }
+
+    // Freeing memory used for corruption info
+    struct corruption_info *info = disk_info -> corr_info;
+    struct corruption_info *next = NULL;
+    while (info != NULL) {
+        next = info -> next;
+        free(info);
+        info = next;
+    }
+    disk_info -> corr_info = NULL;
+    free_cluster_state(&disk_info -> state);
+    if (disk_info -> windows != NULL) {
+        window_close(disk_info -> windows);
+        disk_info -> windows = NULL;
+    }
+    free_fat_graph(&disk_info -> graph);
+    free(disk_info -> recs);
+    free(disk_info -> owner);
+    free(disk_info -> found);
+    return has_error;
+}
+
+/*
+ * Fleet mode. Images are handed out to a pool of threads, each of which
+ * checks one image at a time on its own. A thread only maps an image
+ * once the total mapped stays under the cap (or nothing else is mapped,
+ * so one huge image can't wedge us). Each report is kept in memory until
+ * every image listed before it is out, so the output is in list order.
+ */
+#define FLEET_PENDING (-1)
+#define FLEET_CLEAN 0
+#define FLEET_BAD 1
+#define FLEET_ERROR 2
+
+#define DEFAULT_MAX_MAPPED 1024     // MB
+
+struct fleet_image {
+    char *path;
+    int status;
+    int file_errors;
+    int cluster_errors;
+    int plan_edits;
+    char *report;
+    size_t report_len;
+};
+
+struct fleet {
+    struct fleet_image *images;
+    int nimages;
+    int next;               // next image to hand out
+    size_t max_mapped;
+    size_t mapped;
+    int checkpoint;         // keep a checkpoint next to each image
+    int plan;               // write a repair plan next to each bad image
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // mapped went down, or an image finished
+};
+
+// Is the boot sector one we can trust to walk the image with?
+int image_is_sane(struct bpb33 *bpb, size_t size) {
+    int bps = bpb -> bpbBytesPerSec;
+
+    if (bps < 512 || bps > 4096 || (bps & (bps - 1)) != 0 ||
+        bpb -> bpbSecPerClust == 0 || bpb -> bpbFATs == 0 ||
+        bpb -> bpbFATsecs == 0 || bpb -> bpbSectors < 3) {
+        return 0;
+    }
+    if (meta_sectors(bpb) >= bpb -> bpbSectors ||
+        (size_t)bpb -> bpbSectors * bps > size) {
+        return 0;
+    }
+    // every cluster we look at needs a FAT12 entry
+    return (uint32_t)bpb -> bpbFATsecs * bps * 2 / 3 >= num_clusters(bpb);
+}
+
+void fleet_check(struct fleet_image *img, size_t size, int checkpoint,
+                 int plan) {
+    FILE *out = open_memstream(&img -> report, &img -> report_len);
     uint8_t *image_buf;
     int fd;
+
+    img -> status = FLEET_ERROR;
+    image_buf = size < 512 ? NULL : map_image(img -> path, &fd, MAP_IMAGE_PRIVATE);
+    if (image_buf == NULL) {
+        fprintf(out, "Cannot map the image\n");
+        fclose(out);
+        return;
+    }
+
+    // We only look, but don't let anybody change it under us
+    lock_image(fd, F_RDLCK);
+    struct bpb33 *bpb = check_bootsector(image_buf);
+    if (!image_is_sane(bpb, size)) {
+        fprintf(out, "Not a FAT12 image we can check\n");
+    } else {
+        struct disk_info disk_info;
+        struct repair_plan repairs;
+        memset(&repairs, 0, sizeof(repairs));
+        disk_info.image_buf = image_buf;
+        disk_info.bpb = bpb;
+        disk_info.nthreads = 1;
+        disk_info.out = out;
+        disk_info.checkpoint = checkpoint ? checkpoint_path(img -> path) : NULL;
+        disk_info.fd = fd;
+        disk_info.plan = plan ? &repairs : NULL;
+        disk_info.mem_limit = 0;
+        // the fixes only reach our private copy of the image
+        img -> status = scan_image(&disk_info, plan) ? FLEET_BAD : FLEET_CLEAN;
+        free(disk_info.checkpoint);
+        if (repairs.nedits > 0) {
+            char *path = malloc(strlen(img -> path) + 6);
+            sprintf(path, "%s.plan", img -> path);
+            if (write_plan(&repairs, path, 0) == 0) {
+                img -> plan_edits = repairs.nedits;
+            }
+            free(path);
+        }
+        free_plan(&repairs);
+        img -> file_errors = disk_info.file_errors;
+        img -> cluster_errors = disk_info.cluster_errors;
+    }
+    lock_image(fd, F_UNLCK);
+    unmmap_file(image_buf, &fd);
+    free(bpb);
+    fclose(out);
+}
+
+void *fleet_worker(void *arg) {
+    struct fleet *fleet = arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&fleet -> next, 1, __ATOMIC_RELAXED)) <
+           fleet -> nimages) {
+        struct fleet_image *img = &fleet -> images[i];
+        struct stat st;
+        size_t size = stat(img -> path, &st) == 0 ? st.st_size : 0;
+
+        pthread_mutex_lock(&fleet -> lock);
+        while (fleet -> mapped > 0 && fleet -> mapped + size > fleet -> max_mapped) {
+            pthread_cond_wait(&fleet -> changed, &fleet -> lock);
+        }
+        fleet -> mapped += size;
+        pthread_mutex_unlock(&fleet -> lock);
+
+        struct fleet_image result = *img;
+        fleet_check(&result, size, fleet -> checkpoint, fleet -> plan);
+
+        pthread_mutex_lock(&fleet -> lock);
+        fleet -> mapped -= size;
+        *img = result;
+        pthread_cond_broadcast(&fleet -> changed);
+        pthread_mutex_unlock(&fleet -> lock);
+    }
+    return NULL;
+}
+
+// Write s as a JSON string. Names in a bad image can be any bytes at all
+void json_string(FILE *out, char *s, size_t len) {
+    fputc('"', out);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c == '\n') {
+            fprintf(out, "\\n");
+        } else if (c < 0x20 || c >= 0x7f) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void fleet_add(struct fleet *fleet, int *cap, char *path) {
+    if (fleet -> nimages == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        fleet -> images = realloc(fleet -> images,
+                                  *cap * sizeof(struct fleet_image));
+    }
+    struct fleet_image *img = &fleet -> images[fleet -> nimages++];
+    memset(img, 0, sizeof(struct fleet_image));
+    img -> path = path;
+    img -> status = FLEET_PENDING;
+}
+
+int is_image_name(const struct dirent *entry) {
+    size_t len = strlen(entry -> d_name);
+    return len > 4 && strcmp(entry -> d_name + len - 4, ".img") == 0;
+}
+
+// Fill the fleet from a directory of images, or a list of them
+void fleet_load(struct fleet *fleet, char *source) {
+    struct stat st;
+    int cap = 0;
+
+    if (stat(source, &st) == 0 && S_ISDIR(st.st_mode)) {
+        struct dirent **names;
+        int n = scandir(source, &names, is_image_name, alphasort);
+        if (n < 0) {
+            fprintf(stderr, "Cannot read directory %s: %s\n", source, strerror(errno));
+            exit(1);
+        }
+        for (int i = 0; i < n; i++) {
+            char *path = malloc(strlen(source) + strlen(names[i] -> d_name) + 2);
+            sprintf(path, "%s/%s", source, names[i] -> d_name);
+            fleet_add(fleet, &cap, path);
+            free(names[i]);
+        }
+        free(names);
+        return;
+    }
+
+    FILE *list = strcmp(source, "-") == 0 ? stdin : fopen(source, "r");
+    if (list == NULL) {
+        fprintf(stderr, "Cannot read list %s: %s\n", source, strerror(errno));
+        exit(1);
+    }
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &linecap, list)) > 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            fleet_add(fleet, &cap, strdup(line));
+        }
+    }
+    free(line);
+    if (list != stdin) {
+        fclose(list);
+    }
+}
+
+int run_fleet(char *source, int nthreads, size_t max_mapped, int checkpoint,
+              int plan) {
+    static char *status_names[] = { "clean", "bad", "error" };
+    struct fleet fleet;
+    int count[3] = { 0, 0, 0 };
+
+    memset(&fleet, 0, sizeof(struct fleet));
+    fleet.max_mapped = max_mapped;
+    fleet.checkpoint = checkpoint;
+    fleet.plan = plan;
+    pthread_mutex_init(&fleet.lock, NULL);
+    pthread_cond_init(&fleet.changed, NULL);
+    fleet_load(&fleet, source);
+
+    if (nthreads > fleet.nimages) {
+        nthreads = fleet.nimages;
+    }
+    pthread_t *threads = malloc((nthreads > 0 ? nthreads : 1) * sizeof(pthread_t));
+    int started = 0;
+    while (started < nthreads &&
+           pthread_create(&threads[started], NULL, fleet_worker, &fleet) == 0) {
+        started ++;
+    }
+    // With no workers nothing would ever leave FLEET_PENDING, so check
+    // them all here before reporting
+    if (started == 0) {
+        fleet_worker(&fleet);
+    }
+
+    // Reports go out in list order as soon as they can
+    printf("{\"images\":[");
+    for (int i = 0; i < fleet.nimages; i++) {
+        struct fleet_image *img = &fleet.images[i];
+
+        pthread_mutex_lock(&fleet.lock);
+        while (img -> status == FLEET_PENDING) {
+            pthread_cond_wait(&fleet.changed, &fleet.lock);
+        }
+        pthread_mutex_unlock(&fleet.lock);
+
+        count[img -> status] ++;
+        printf("%s\n{\"image\":", i == 0 ? "" : ",");
+        json_string(stdout, img -> path, strlen(img -> path));
+        printf(",\"status\":\"%s\",\"file_errors\":%d,\"cluster_errors\":%d,"
+               "\"plan_edits\":%d,\"report\":", status_names[img -> status],
+               img -> file_errors, img -> cluster_errors, img -> plan_edits);
+        json_string(stdout, img -> report, img -> report_len);
+        printf("}");
+        free(img -> report);
+        free(img -> path);
+    }
+    printf("%s],\n\"summary\":{\"images\":%d,\"clean\":%d,\"bad\":%d,\"error\":%d}}\n",
+           fleet.nimages ? "\n" : "", fleet.nimages,
+           count[FLEET_CLEAN], count[FLEET_BAD], count[FLEET_ERROR]);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(fleet.images);
+    pthread_cond_destroy(&fleet.changed);
+    pthread_mutex_destroy(&fleet.lock);
+    return count[FLEET_BAD] + count[FLEET_ERROR] > 0;
+}
+
+int main(int argc, char** argv) {
+    uint8_t *image_buf;
+    int fd, opt;
+    int nthreads = 0;
+    int checkpoint = 0;
+    int plan_only = 0;
+    char *fleet = NULL;
+    char *apply = NULL;
+    size_t max_mapped = DEFAULT_MAX_MAPPED;
+    size_t mem_limit = 0;
     struct bpb33* bpb;
-    if (argc < 2) {
+    struct repair_plan plan;
+    static struct option longopts[] = {
+        { "fleet", required_argument, NULL, 'F' },
+        { "max-mapped", required_argument, NULL, 'M' },
+        { "apply", required_argument, NULL, 'A' },
+        { "mem-limit", required_argument, NULL, 'L' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    while ((opt = getopt_long(argc, argv, "cpj:", longopts, NULL)) != -1) {
+        if (opt == 'j') {
+            nthreads = atoi(optarg);
+            if (nthreads > MAX_THREADS) {
+                nthreads = MAX_THREADS;
+            }
+        } else if (opt == 'c') {
+            checkpoint = 1;
+        } else if (opt == 'p') {
+            plan_only = 1;
+        } else if (opt == 'F') {
+            fleet = optarg;
+        } else if (opt == 'M') {
+            max_mapped = atol(optarg);
+        } else if (opt == 'A') {
+            apply = optarg;
+        } else if (opt == 'L') {
+            mem_limit = atol(optarg) * 1024;
+            if (mem_limit == 0) {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (fleet != NULL) {
+        if (argc - optind != 0 || mem_limit != 0) {
+            usage(argv[0]);
+        }
+        if (nthreads < 1) {
+            nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        if (nthreads > MAX_THREADS) {
+            nthreads = MAX_THREADS;
+        }
+        return run_fleet(fleet, nthreads < 1 ? 1 : nthreads,
+                         max_mapped * 1024 * 1024, checkpoint, plan_only);
+    }
+
+    if (argc - optind < 1) {
 	    usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
+    if (apply != NULL) {
+        char *undo = malloc(strlen(apply) + 6);
+        sprintf(undo, "%s.undo", apply);
+        int ret = read_plan(&plan, apply) < 0 ||
+                  apply_plan(&plan, argv[optind], undo) < 0;
+        if (ret == 0) {
+            printf("Applied %d edits from %s; %s takes them back\n",
+                   plan.nedits, apply, undo);
+        }
+        free_plan(&plan);
+        free(undo);
+        return ret;
+    }
+
+    // Only look for now: the fixes go to a private copy of the image,
+    // and come out as a plan to apply at the end
+    image_buf = map_image(argv[optind], &fd, MAP_IMAGE_PRIVATE);
+    if (image_buf == NULL) {
+        exit(1);
+    }
+    lock_image(fd, F_RDLCK);
     bpb = check_bootsector(image_buf);
 
     // your code should start here...
 
-    int num_cluster = bpb -> bpbSectors;
-
-    // Array to keep track of cluster info
-    uint8_t cluster_info[num_cluster];
-    for (int i = 0; i < num_cluster; i++) {
-        cluster_info[i] = CLUSTER_ZEROMASK;
-    }
-    
     // Putting the general info together in one struct
     struct disk_info disk_info;
+    memset(&plan, 0, sizeof(plan));
     disk_info.image_buf = image_buf;
     disk_info.bpb = bpb;
-    disk_info.cluster_info = cluster_info;
-    disk_info.corr_info = NULL;
+    disk_info.nthreads = nthreads < 1 ? 1 : nthreads;
+    disk_info.out = stdout;
+    disk_info.checkpoint = checkpoint ? checkpoint_path(argv[optind]) : NULL;
+    disk_info.fd = fd;
+    disk_info.plan = &plan;
+    disk_info.mem_limit = mem_limit;
 
-    printf("==================\n");
-   
-    if (data_is_inconsistent(&disk_info)) {
-        fix_corruption(&disk_info);
-    } else {
-        printf("Yay we are free of error!\n");
-    }
+    scan_image(&disk_info, 1);
+    free(disk_info.checkpoint);
 
+    lock_image(fd, F_UNLCK);
     unmmap_file(image_buf, &fd);
     free(bpb);
-    return 0;
+
+    int ret = 0;
+    if (plan.nedits > 0) {
+        char *path = malloc(strlen(argv[optind]) + 6);
+        sprintf(path, "%s.plan", argv[optind]);
+        if (plan_only) {
+            ret = write_plan(&plan, path, 0) < 0;
+        } else {
+            // the repairs can be taken back, as with --apply
+            char *undo = malloc(strlen(argv[optind]) + 6);
+            sprintf(undo, "%s.undo", argv[optind]);
+            ret = apply_plan(&plan, argv[optind], undo) < 0;
+            if (ret == 0) {
+                printf("%s takes the repairs back\n", undo);
+            }
+            free(undo);
+        }
+        free(path);
+    }
+    free_plan(&plan);
+    return ret;
 }